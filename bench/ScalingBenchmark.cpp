@@ -0,0 +1,221 @@
+// Scaling benchmark of the generator. Builds a synthetic model with thousands
+// of operators and tensors and times the steps whose cost grows with the
+// graph: lifetime analysis, memory planner setup and tensor names.
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "OptimalMemPlanner.h"
+#include "TensorNames.h"
+#include "TensorPlanning.h"
+#include "tensorflow/lite/micro/kernels/all_ops_resolver.h"
+#include "tensorflow/lite/micro/memory_planner/greedy_memory_planner.h"
+#include "tensorflow/lite/micro/micro_error_reporter.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/version.h"
+
+namespace {
+struct Options {
+  int numOps = 10000;
+  // Every operation also reads the output of the last operation whose index
+  // is a multiple of skipDistance, so lifetimes have different lengths.
+  int skipDistance = 64;
+  size_t arenaSize = 64 << 20;
+  // Fails the run if a step takes longer, 0 for no limit.
+  double maxStepMs = 0;
+};
+
+void PrintUsage() {
+  printf("Usage: scaling-benchmark [options]\n");
+  printf("Options:\n");
+  printf("  --ops=<n>            Number of operations (default: 10000)\n");
+  printf("  --skip=<n>           Distance of skip connections (default: 64)\n");
+  printf("  --arena-size=<n>     Arena of the TFLM interpreter in bytes\n");
+  printf("  --max-step-ms=<ms>   Fail if a step takes longer\n");
+}
+
+// Parses value as a decimal integer in [min, max]. Unlike std::stoi, this
+// fails on trailing characters and out of range values instead of throwing.
+template <typename T>
+bool ParseInt(const std::string &value, long long min, long long max, T *out) {
+  if (value.empty() || isspace(value[0])) return false;
+  char *end;
+  errno = 0;
+  long long n = strtoll(value.c_str(), &end, 10);
+  if (errno == ERANGE || *end != '\0' || n < min || n > max) return false;
+  *out = n;
+  return true;
+}
+
+// Parses value as a non-negative decimal number.
+bool ParseDouble(const std::string &value, double *out) {
+  if (value.empty() || isspace(value[0])) return false;
+  char *end;
+  errno = 0;
+  double x = strtod(value.c_str(), &end);
+  if (errno == ERANGE || *end != '\0' || !(x >= 0)) return false;
+  *out = x;
+  return true;
+}
+
+bool ParseArgs(int argc, char *argv[], Options *options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value = arg.substr(arg.find('=') + 1);
+    if (arg.rfind("--ops=", 0) == 0) {
+      // Tensor indices go up to numOps.
+      if (!ParseInt(value, 1, INT_MAX - 1, &options->numOps)) return false;
+    } else if (arg.rfind("--skip=", 0) == 0) {
+      if (!ParseInt(value, 1, INT_MAX, &options->skipDistance)) return false;
+    } else if (arg.rfind("--arena-size=", 0) == 0) {
+      if (!ParseInt(value, 1, LONG_MAX, &options->arenaSize)) return false;
+    } else if (arg.rfind("--max-step-ms=", 0) == 0) {
+      if (!ParseDouble(value, &options->maxStepMs)) return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns a model of numOps float ADD operations with numOps + 1 tensors.
+// Operation i adds tensor i and the last tensor whose index is a multiple of
+// skipDistance into tensor i + 1.
+std::vector<uint8_t> BuildModel(int numOps, int skipDistance) {
+  flatbuffers::FlatBufferBuilder fbb;
+  std::vector<flatbuffers::Offset<tflite::Buffer>> buffers = {
+      tflite::CreateBuffer(fbb)};
+  std::vector<int32_t> shape = {1, 16};
+  std::vector<flatbuffers::Offset<tflite::Tensor>> tensors;
+  for (int t = 0; t <= numOps; t++) {
+    tensors.push_back(tflite::CreateTensor(fbb, fbb.CreateVector(shape),
+                                           tflite::TensorType_FLOAT32, 0));
+  }
+  std::vector<flatbuffers::Offset<tflite::Operator>> operators;
+  for (int i = 0; i < numOps; i++) {
+    std::vector<int32_t> inputs = {i, i / skipDistance * skipDistance};
+    std::vector<int32_t> outputs = {i + 1};
+    operators.push_back(tflite::CreateOperator(
+        fbb, 0, fbb.CreateVector(inputs), fbb.CreateVector(outputs),
+        tflite::BuiltinOptions_AddOptions,
+        tflite::CreateAddOptions(fbb).Union()));
+  }
+  std::vector<int32_t> graphInputs = {0};
+  std::vector<int32_t> graphOutputs = {numOps};
+  std::vector<flatbuffers::Offset<tflite::SubGraph>> subgraphs = {
+      tflite::CreateSubGraph(fbb, fbb.CreateVector(tensors),
+                             fbb.CreateVector(graphInputs),
+                             fbb.CreateVector(graphOutputs),
+                             fbb.CreateVector(operators))};
+  std::vector<flatbuffers::Offset<tflite::OperatorCode>> operatorCodes = {
+      tflite::CreateOperatorCode(fbb, tflite::BuiltinOperator_ADD)};
+  auto model = tflite::CreateModel(
+      fbb, TFLITE_SCHEMA_VERSION, fbb.CreateVector(operatorCodes),
+      fbb.CreateVector(subgraphs), fbb.CreateString("scaling benchmark"),
+      fbb.CreateVector(buffers));
+  tflite::FinishModelBuffer(fbb, model);
+  return std::vector<uint8_t>(fbb.GetBufferPointer(),
+                              fbb.GetBufferPointer() + fbb.GetSize());
+}
+
+// Adds a buffer per tensor that needs one, like the generator does. Returns
+// the number of buffers.
+int AddBuffers(tflite::MicroInterpreter *interpreter,
+               const std::vector<TensorLifetime> &lifetimes,
+               tflite::MemoryPlanner *planner,
+               tflite::ErrorReporter *errorReporter) {
+  int numBuffers = 0;
+  for (int i = 0; i < interpreter->tensors_size(); i++) {
+    if (!lifetimes[i].needsAlloc) continue;
+    int size = (interpreter->tensor(i)->bytes + 15) / 16 * 16;
+    planner->AddBuffer(errorReporter, size, lifetimes[i].firstUse,
+                       lifetimes[i].lastUse);
+    numBuffers++;
+  }
+  return numBuffers;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    PrintUsage();
+    return 1;
+  }
+
+  auto modelData = BuildModel(options.numOps, options.skipDistance);
+  const tflite::Model *model = tflite::GetModel(modelData.data());
+  tflite::MicroErrorReporter errorReporter;
+  tflite::ops::micro::AllOpsResolver resolver;
+  std::vector<uint8_t> arena(options.arenaSize);
+  tflite::MicroInterpreter interpreter(model, resolver, arena.data(),
+                                       arena.size(), &errorReporter);
+  printf("%lu operations, %lu tensors\n", interpreter.operators_size(),
+         interpreter.tensors_size());
+
+  bool withinLimit = true;
+  auto TimeStep = [&](const char *name, const std::function<void()> &step) {
+    auto start = std::chrono::steady_clock::now();
+    step();
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    printf("%-24s %10.2f ms\n", name, ms);
+    if (options.maxStepMs > 0 && ms > options.maxStepMs) {
+      printf("%s took longer than %.2f ms\n", name, options.maxStepMs);
+      withinLimit = false;
+    }
+  };
+
+  // Like in the generator, this must be called before AllocateTensors, which
+  // marks all tensors as allocated.
+  std::vector<TensorLifetime> lifetimes;
+  TimeStep("tensor lifetimes",
+           [&]() { lifetimes = GetTensorLifetimes(&interpreter); });
+
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    printf("AllocateTensors() failed, try a bigger --arena-size\n");
+    return 1;
+  }
+
+  size_t plannedSize = 0;
+  int numBuffers = 0;
+  TimeStep("greedy planner", [&]() {
+    std::vector<uint8_t> plannerBuf(
+        interpreter.tensors_size() *
+        tflite::GreedyMemoryPlanner::per_buffer_size());
+    tflite::GreedyMemoryPlanner planner(plannerBuf.data(), plannerBuf.size());
+    numBuffers = AddBuffers(&interpreter, lifetimes, &planner, &errorReporter);
+    plannedSize = planner.GetMaximumMemorySize();
+  });
+  // The planner timings are meaningless without buffers.
+  if (numBuffers == 0) {
+    printf("no tensor needs a buffer\n");
+    return 1;
+  }
+  printf("%-24s %10d\n", "planned buffers", numBuffers);
+  printf("%-24s %10lu bytes\n", "greedy plan", plannedSize);
+
+  // Without search time, this is the setup of the optimal planner: time
+  // slots, conflicts and the greedy upper bounds.
+  TimeStep("optimal planner setup", [&]() {
+    OptimalMemPlanner planner(0);
+    AddBuffers(&interpreter, lifetimes, &planner, &errorReporter);
+    plannedSize = planner.GetMaximumMemorySize();
+  });
+  printf("%-24s %10lu bytes\n", "optimal planner plan", plannedSize);
+
+  std::vector<std::string> tensorNames;
+  TimeStep("tensor names",
+           [&]() { tensorNames = GetTensorNames(interpreter); });
+
+  return withinLimit ? 0 : 1;
+}
@@ -0,0 +1,245 @@
+// Host harness for generated code. Runs the generated Eval() and the TFLM
+// interpreter on the same inputs, compares their outputs bit-exactly and
+// reports the latency of both.
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tensorflow/lite/micro/kernels/all_ops_resolver.h"
+#include "tensorflow/lite/micro/micro_error_reporter.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+#include "tensorflow/lite/version.h"
+
+// Generated code.
+#ifdef HARNESS_MULTI_INSTANCE
+struct ModelInstance;
+ModelInstance *CreateInstance();
+void DestroyInstance(ModelInstance *inst);
+void Setup(ModelInstance *inst);
+void Eval(ModelInstance *inst);
+void *GetInputPtr(ModelInstance *inst, int index);
+const void *GetOutputPtr(ModelInstance *inst, int index);
+#define INST_ARG g_inst,
+#else
+void Setup();
+void Eval();
+void *GetInputPtr(int index);
+const void *GetOutputPtr(int index);
+#define INST_ARG
+#endif
+
+namespace {
+#ifdef HARNESS_MULTI_INSTANCE
+ModelInstance *g_inst;
+#endif
+
+struct Options {
+  int iterations = 100;
+  unsigned seed = 1;
+  // Raw input tensors of consecutive inferences. Random if empty.
+  std::string inputsFile;
+  size_t arenaSize = 4 << 20;
+};
+
+void PrintUsage() {
+  printf("Usage: harness [options] modelFile.tflite\n");
+  printf("Options:\n");
+  printf("  --iterations=<n>     Number of inferences (default: 100)\n");
+  printf("  --seed=<n>           Seed of random inputs\n");
+  printf("  --inputs=<file>      Recorded inputs instead of random ones\n");
+  printf("  --arena-size=<n>     Arena of the TFLM interpreter in bytes\n");
+}
+
+// Parses value as a decimal integer in [min, max]. Unlike std::stoi, this
+// fails on trailing characters and out of range values instead of throwing.
+template <typename T>
+bool ParseInt(const std::string &value, long long min, long long max, T *out) {
+  if (value.empty() || isspace(value[0])) return false;
+  char *end;
+  errno = 0;
+  long long n = strtoll(value.c_str(), &end, 10);
+  if (errno == ERANGE || *end != '\0' || n < min || n > max) return false;
+  *out = n;
+  return true;
+}
+
+bool ParseArgs(int argc, char *argv[], Options *options,
+               std::string *modelFileName) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string value = arg.substr(arg.find('=') + 1);
+    if (arg.rfind("--iterations=", 0) == 0) {
+      if (!ParseInt(value, 1, INT_MAX, &options->iterations)) return false;
+    } else if (arg.rfind("--seed=", 0) == 0) {
+      if (!ParseInt(value, 0, UINT_MAX, &options->seed)) return false;
+    } else if (arg.rfind("--inputs=", 0) == 0) {
+      options->inputsFile = value;
+    } else if (arg.rfind("--arena-size=", 0) == 0) {
+      if (!ParseInt(value, 1, LONG_MAX, &options->arenaSize)) return false;
+    } else if (arg.rfind("--", 0) == 0 || !modelFileName->empty()) {
+      return false;
+    } else {
+      *modelFileName = arg;
+    }
+  }
+  return !modelFileName->empty() && options->iterations > 0;
+}
+
+bool ReadFile(const std::string &fileName, std::vector<char> *data) {
+  std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+  if (!file) {
+    return false;
+  }
+  data->resize(file.tellg());
+  file.seekg(0, std::ios::beg);
+  return (bool)file.read(data->data(), data->size());
+}
+
+// Fills a tensor with random values. Floats stay in [-1, 1], so that
+// no operation sees NaN or infinity.
+void FillRandom(TfLiteTensor *tensor, std::mt19937 *rng) {
+  if (tensor->type == kTfLiteFloat32) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (size_t k = 0; k < tensor->bytes / sizeof(float); k++) {
+      tensor->data.f[k] = dist(*rng);
+    }
+  } else {
+    std::uniform_int_distribution<int> dist(0, 255);
+    for (size_t k = 0; k < tensor->bytes; k++) {
+      tensor->data.uint8[k] = dist(*rng);
+    }
+  }
+}
+
+double Percentile(std::vector<double> values, double p) {
+  std::sort(values.begin(), values.end());
+  size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+  return values[index];
+}
+
+void PrintLatency(const char *name, const std::vector<double> &timesUs) {
+  printf("%-12s p50: %10.1f us  p90: %10.1f us  p99: %10.1f us\n", name,
+         Percentile(timesUs, 0.5), Percentile(timesUs, 0.9),
+         Percentile(timesUs, 0.99));
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  Options options;
+  std::string modelFileName;
+  if (!ParseArgs(argc, argv, &options, &modelFileName)) {
+    PrintUsage();
+    return 1;
+  }
+
+  std::vector<char> modelData;
+  if (!ReadFile(modelFileName, &modelData)) {
+    printf("failed to read model file\n");
+    return 1;
+  }
+  const tflite::Model *model = tflite::GetModel(modelData.data());
+  if (model->version() != TFLITE_SCHEMA_VERSION) {
+    printf("unsupported schema version %d\n", model->version());
+    return 1;
+  }
+
+  tflite::MicroErrorReporter errorReporter;
+  tflite::ops::micro::AllOpsResolver resolver;
+  std::vector<uint8_t> arena(options.arenaSize);
+  tflite::MicroInterpreter interpreter(model, resolver, arena.data(),
+                                       arena.size(), &errorReporter);
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    printf("AllocateTensors() failed, try a bigger --arena-size\n");
+    return 1;
+  }
+
+  size_t inputBytes = 0;
+  for (size_t k = 0; k < interpreter.inputs_size(); k++) {
+    inputBytes += interpreter.input(k)->bytes;
+  }
+  std::vector<char> recordedInputs;
+  if (!options.inputsFile.empty()) {
+    if (!ReadFile(options.inputsFile, &recordedInputs)) {
+      printf("failed to read inputs file\n");
+      return 1;
+    }
+    if (recordedInputs.empty() || recordedInputs.size() % inputBytes) {
+      printf("inputs file must hold a multiple of %lu bytes\n", inputBytes);
+      return 1;
+    }
+  }
+
+#ifdef HARNESS_MULTI_INSTANCE
+  g_inst = CreateInstance();
+#endif
+  Setup(INST_ARG);
+
+  std::mt19937 rng(options.seed);
+  std::vector<double> interpreterTimesUs;
+  std::vector<double> generatedTimesUs;
+  int numMismatches = 0;
+  for (int it = 0; it < options.iterations; it++) {
+    // Inputs go to the interpreter first, then they are copied over.
+    size_t recordOffset =
+        recordedInputs.empty() ? 0 : (it * inputBytes) % recordedInputs.size();
+    for (size_t k = 0; k < interpreter.inputs_size(); k++) {
+      TfLiteTensor *input = interpreter.input(k);
+      if (recordedInputs.empty()) {
+        FillRandom(input, &rng);
+      } else {
+        memcpy(input->data.raw, recordedInputs.data() + recordOffset,
+               input->bytes);
+        recordOffset += input->bytes;
+      }
+      memcpy(GetInputPtr(INST_ARG k), input->data.raw, input->bytes);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (interpreter.Invoke() != kTfLiteOk) {
+      printf("Invoke() failed\n");
+      return 1;
+    }
+    auto mid = std::chrono::steady_clock::now();
+    Eval(INST_ARG);
+    auto end = std::chrono::steady_clock::now();
+    interpreterTimesUs.push_back(
+        std::chrono::duration<double, std::micro>(mid - start).count());
+    generatedTimesUs.push_back(
+        std::chrono::duration<double, std::micro>(end - mid).count());
+
+    for (size_t k = 0; k < interpreter.outputs_size(); k++) {
+      const TfLiteTensor *output = interpreter.output(k);
+      const char *generated = (const char *)GetOutputPtr(INST_ARG k);
+      if (memcmp(output->data.raw, generated, output->bytes) == 0) {
+        continue;
+      }
+      if (numMismatches == 0) {
+        size_t pos = 0;
+        while (output->data.raw[pos] == generated[pos]) pos++;
+        printf("iteration %d: output %lu differs at byte %lu\n", it, k, pos);
+      }
+      numMismatches++;
+    }
+  }
+
+#ifdef HARNESS_MULTI_INSTANCE
+  DestroyInstance(g_inst);
+#endif
+
+  printf("%d iterations, %d mismatching outputs\n", options.iterations,
+         numMismatches);
+  PrintLatency("interpreter", interpreterTimesUs);
+  PrintLatency("generated", generatedTimesUs);
+  return numMismatches ? 1 : 0;
+}
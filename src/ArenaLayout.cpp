@@ -0,0 +1,72 @@
+#include "ArenaLayout.h"
+
+#include <algorithm>
+#include <cassert>
+
+// Target buffers are aligned to 16 bytes, like in TFLM.
+static const uintptr_t kAlignment = 16;
+
+static uintptr_t AlignUp(uintptr_t v, uintptr_t align) {
+  return (v + align - 1) & ~(align - 1);
+}
+
+void ArenaLayout::setPlannedSize(size_t size) {
+  assert(!m_finalized && "Layout is already finalized");
+  m_plannedSize = size;
+}
+
+void ArenaLayout::addBlock(uintptr_t offset, size_t len) {
+  assert(!m_finalized && "Layout is already finalized");
+  m_blocks.push_back({offset, len, 0});
+}
+
+void ArenaLayout::finalize() {
+  // Merge overlapping blocks, they have to stay together.
+  std::sort(m_blocks.begin(), m_blocks.end(),
+            [](const Block &a, const Block &b) { return a.offset < b.offset; });
+  std::vector<Block> merged;
+  for (const auto &block : m_blocks) {
+    if (!merged.empty() &&
+        block.offset < merged.back().offset + merged.back().len) {
+      auto &last = merged.back();
+      last.len = std::max(last.offset + last.len, block.offset + block.len) -
+                 last.offset;
+    } else {
+      merged.push_back(block);
+    }
+  }
+  m_blocks = merged;
+
+  // Pack the blocks behind the planned buffers. Each block keeps the
+  // alignment it had in the offline arena.
+  uintptr_t cursor = AlignUp(m_plannedSize, kAlignment);
+  for (auto &block : m_blocks) {
+    uintptr_t align = kAlignment;
+    while (block.offset % align) {
+      align /= 2;
+    }
+    block.newOffset = AlignUp(cursor, align);
+    cursor = block.newOffset + block.len;
+  }
+  m_size = AlignUp(cursor, kAlignment);
+  m_finalized = true;
+}
+
+const ArenaLayout::Block *ArenaLayout::findBlock(uintptr_t offset) const {
+  auto it = std::upper_bound(m_blocks.begin(), m_blocks.end(), offset,
+                             [](uintptr_t offset, const Block &block) {
+                               return offset < block.offset;
+                             });
+  if (it == m_blocks.begin()) {
+    return nullptr;
+  }
+  --it;
+  return offset <= it->offset + it->len ? &*it : nullptr;
+}
+
+uintptr_t ArenaLayout::relocate(uintptr_t offset) const {
+  assert(m_finalized && "Layout is not finalized");
+  auto block = findBlock(offset);
+  assert(block && "Offset is not part of the arena layout");
+  return block->newOffset + (offset - block->offset);
+}
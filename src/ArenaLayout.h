@@ -0,0 +1,39 @@
+#ifndef OFFLINE_INTERPRETER_ARENALAYOUT_H
+#define OFFLINE_INTERPRETER_ARENALAYOUT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Builds the arena layout of the target. The buffers of the memory plan go
+// first, all other blocks of the offline interpreter's arena that are used on
+// the target (persistent buffers, tensor structs, ...) are packed behind them.
+class ArenaLayout {
+ public:
+  void setPlannedSize(size_t size);
+  // offset: Offset of the block in the offline interpreter's arena.
+  void addBlock(uintptr_t offset, size_t len);
+  void finalize();
+
+  // Translates an offset inside of an added block to the target arena.
+  uintptr_t relocate(uintptr_t offset) const;
+  bool contains(uintptr_t offset) const {
+    return findBlock(offset) != nullptr;
+  }
+  size_t getSize() const { return m_size; }
+
+ private:
+  struct Block {
+    uintptr_t offset;
+    size_t len;
+    uintptr_t newOffset;
+  };
+  const Block *findBlock(uintptr_t offset) const;
+
+  std::vector<Block> m_blocks;
+  size_t m_plannedSize = 0;
+  size_t m_size = 0;
+  bool m_finalized = false;
+};
+
+#endif
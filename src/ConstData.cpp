@@ -0,0 +1,107 @@
+#include "ConstData.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <map>
+
+// Alignment of the constant data on the target.
+static const uintptr_t kMaxAlignment = 16;
+
+static uintptr_t AlignUp(uintptr_t v, uintptr_t align) {
+  return (v + align - 1) & ~(align - 1);
+}
+
+// FNV-1a, candidates with the same hash are compared byte by byte.
+static uint64_t GetHash(const char *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+ConstData::ConstData(const std::vector<char> &fb)
+    : m_fb(fb), m_extraBase(AlignUp(fb.size(), kMaxAlignment)) {}
+
+void ConstData::addBlock(uintptr_t offset, size_t len) {
+  assert(!m_finalized && "Constant data is already finalized");
+  m_blocks.push_back({offset, len, 0});
+}
+
+uintptr_t ConstData::addData(const void *data, size_t len) {
+  uintptr_t offset = m_extraBase + m_extra.size();
+  m_extra.insert(m_extra.end(), (const char *)data, (const char *)data + len);
+  m_extra.resize(AlignUp(m_extra.size(), kMaxAlignment));
+  addBlock(offset, len);
+  return offset;
+}
+
+void ConstData::finalize() {
+  // Merge overlapping blocks, they have to stay together.
+  std::sort(m_blocks.begin(), m_blocks.end(),
+            [](const Block &a, const Block &b) { return a.offset < b.offset; });
+  std::vector<Block> merged;
+  for (const auto &block : m_blocks) {
+    if (!merged.empty() &&
+        block.offset < merged.back().offset + merged.back().len) {
+      auto &last = merged.back();
+      last.len = std::max(last.offset + last.len, block.offset + block.len) -
+                 last.offset;
+    } else {
+      merged.push_back(block);
+    }
+  }
+  m_blocks = merged;
+
+  // Copy the blocks, each keeps the alignment it had in the flatbuffer.
+  // Identical blocks are only stored once. They are found by hash and length,
+  // so the contents are not copied again.
+  std::multimap<std::pair<uint64_t, size_t>, uintptr_t> stored;
+  for (auto &block : m_blocks) {
+    uintptr_t align = kMaxAlignment;
+    while (block.offset % align) {
+      align /= 2;
+    }
+    const char *src = block.offset < m_extraBase
+                          ? m_fb.data() + block.offset
+                          : m_extra.data() + (block.offset - m_extraBase);
+    auto key = std::make_pair(GetHash(src, block.len), block.len);
+    auto candidates = stored.equal_range(key);
+    auto it = candidates.first;
+    while (it != candidates.second &&
+           (it->second % align != 0 ||
+            memcmp(m_data.data() + it->second, src, block.len) != 0)) {
+      ++it;
+    }
+    if (it != candidates.second) {
+      block.newOffset = it->second;
+      m_numDeduplicated++;
+      continue;
+    }
+    block.newOffset = AlignUp(m_data.size(), align);
+    m_data.resize(block.newOffset);
+    m_data.insert(m_data.end(), src, src + block.len);
+    stored.insert({key, block.newOffset});
+  }
+  m_finalized = true;
+}
+
+const ConstData::Block *ConstData::findBlock(uintptr_t offset) const {
+  auto it = std::upper_bound(m_blocks.begin(), m_blocks.end(), offset,
+                             [](uintptr_t offset, const Block &block) {
+                               return offset < block.offset;
+                             });
+  if (it == m_blocks.begin()) {
+    return nullptr;
+  }
+  --it;
+  return offset <= it->offset + it->len ? &*it : nullptr;
+}
+
+uintptr_t ConstData::relocate(uintptr_t offset) const {
+  assert(m_finalized && "Constant data is not finalized");
+  auto block = findBlock(offset);
+  assert(block && "Offset is not part of the constant data");
+  return block->newOffset + (offset - block->offset);
+}
@@ -0,0 +1,49 @@
+#ifndef OFFLINE_INTERPRETER_CONSTDATA_H
+#define OFFLINE_INTERPRETER_CONSTDATA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Builds the constant data of the target. Only the blocks of the flatbuffer
+// that the target code points to are kept (weights, dims, ...) and blocks
+// with identical contents are stored once.
+class ConstData {
+ public:
+  explicit ConstData(const std::vector<char> &fb);
+
+  // offset: Offset of the block in the flatbuffer.
+  void addBlock(uintptr_t offset, size_t len);
+  // Adds data that is not part of the flatbuffer, e.g. constant folded
+  // tensors. Returns its offset behind the end of the flatbuffer, which is
+  // relocated like flatbuffer offsets.
+  uintptr_t addData(const void *data, size_t len);
+  void finalize();
+
+  // Translates an offset inside of an added block to the constant data.
+  uintptr_t relocate(uintptr_t offset) const;
+  bool contains(uintptr_t offset) const {
+    return findBlock(offset) != nullptr;
+  }
+  const std::vector<char> &getData() const { return m_data; }
+  int getNumDeduplicated() const { return m_numDeduplicated; }
+
+ private:
+  struct Block {
+    uintptr_t offset;
+    size_t len;
+    uintptr_t newOffset;
+  };
+  const Block *findBlock(uintptr_t offset) const;
+
+  const std::vector<char> &m_fb;
+  // Data added with addData, starts at m_extraBase.
+  std::vector<char> m_extra;
+  uintptr_t m_extraBase;
+  std::vector<Block> m_blocks;
+  std::vector<char> m_data;
+  int m_numDeduplicated = 0;
+  bool m_finalized = false;
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include "InPlacePlanning.h"
+
+#include <algorithm>
+
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+namespace {
+// Whether the kernel computes each output element only from the input
+// elements at the same position, so that the output may overwrite an input
+// of the same shape. RESHAPE skips its copy when both share the data.
+bool IsInPlaceOperation(tflite::BuiltinOperator code) {
+  switch (code) {
+    case tflite::BuiltinOperator_ABS:
+    case tflite::BuiltinOperator_ADD:
+    case tflite::BuiltinOperator_CEIL:
+    case tflite::BuiltinOperator_COS:
+    case tflite::BuiltinOperator_FLOOR:
+    case tflite::BuiltinOperator_LOG:
+    case tflite::BuiltinOperator_LOGICAL_NOT:
+    case tflite::BuiltinOperator_LOGISTIC:
+    case tflite::BuiltinOperator_MAXIMUM:
+    case tflite::BuiltinOperator_MINIMUM:
+    case tflite::BuiltinOperator_MUL:
+    case tflite::BuiltinOperator_NEG:
+    case tflite::BuiltinOperator_PRELU:
+    case tflite::BuiltinOperator_QUANTIZE:
+    case tflite::BuiltinOperator_RELU:
+    case tflite::BuiltinOperator_RELU6:
+    case tflite::BuiltinOperator_RESHAPE:
+    case tflite::BuiltinOperator_ROUND:
+    case tflite::BuiltinOperator_RSQRT:
+    case tflite::BuiltinOperator_SIN:
+    case tflite::BuiltinOperator_SQRT:
+    case tflite::BuiltinOperator_SQUARE:
+    case tflite::BuiltinOperator_SUB:
+    case tflite::BuiltinOperator_TANH:
+      return true;
+    default:
+      return false;
+  }
+}
+}  // namespace
+
+std::vector<bool> FindViewOperations(
+    tflite::MicroInterpreter *interpreter, const std::vector<int> &schedule,
+    const std::vector<TensorLifetime> &lifetimes,
+    std::map<int, int> *viewInputs) {
+  std::vector<bool> isView(interpreter->operators_size());
+  for (int i : schedule) {
+    auto nodeAndReg = interpreter->node_and_registration(i);
+    auto code = static_cast<tflite::BuiltinOperator>(
+        nodeAndReg.registration->builtin_code);
+    const auto &node = nodeAndReg.node;
+    if (node.inputs->size < 1 || node.outputs->size != 1) continue;
+    int in = node.inputs->data[0];
+    int out = node.outputs->data[0];
+    if (in < 0 || !lifetimes[in].needsAlloc || !lifetimes[out].needsAlloc) {
+      continue;
+    }
+    auto input = interpreter->tensor(in);
+    auto output = interpreter->tensor(out);
+    if (input->type != output->type || input->bytes != output->bytes) {
+      continue;
+    }
+    bool keepsData = code == tflite::BuiltinOperator_RESHAPE ||
+                     code == tflite::BuiltinOperator_SQUEEZE ||
+                     code == tflite::BuiltinOperator_EXPAND_DIMS;
+    if (code == tflite::BuiltinOperator_QUANTIZE) {
+      keepsData = input->params.scale == output->params.scale &&
+                  input->params.zero_point == output->params.zero_point;
+    }
+    if (keepsData) {
+      isView[i] = true;
+      (*viewInputs)[out] = in;
+    }
+  }
+  return isView;
+}
+
+std::map<int, int> PlanSharedBuffers(
+    tflite::MicroInterpreter *interpreter, const std::vector<int> &schedule,
+    const FusionPlan &fusion, const std::vector<TensorLifetime> &lifetimes,
+    const std::map<int, int> &viewInputs, bool inPlace) {
+  // Tensors form trees of shared buffers, the owner is at the root. The last
+  // use of a buffer is tracked at its owner.
+  std::map<int, int> parents;
+  std::map<int, int> bufferLastUse;
+  auto GetOwner = [&](int t) {
+    int owner = t;
+    for (auto it = parents.find(owner); it != parents.end();
+         it = parents.find(owner)) {
+      owner = it->second;
+    }
+    // Point the path at the owner, so that long chains stay cheap.
+    while (t != owner) {
+      auto &parent = parents[t];
+      t = parent;
+      parent = owner;
+    }
+    return owner;
+  };
+  auto GetLastUse = [&](int owner) {
+    auto it = bufferLastUse.find(owner);
+    return it != bufferLastUse.end() ? it->second : lifetimes[owner].lastUse;
+  };
+  auto Share = [&](int t, int owner) {
+    bufferLastUse[owner] = std::max(GetLastUse(owner), GetLastUse(t));
+    parents[t] = owner;
+  };
+
+  for (const auto &view : viewInputs) {
+    Share(view.first, GetOwner(view.second));
+  }
+
+  for (int i : schedule) {
+    if (!inPlace) break;
+    auto nodeAndReg = interpreter->node_and_registration(i);
+    auto code = static_cast<tflite::BuiltinOperator>(
+        nodeAndReg.registration->builtin_code);
+    auto node = nodeAndReg.node;
+    fusion.applyTo(i, &node);
+    if (!IsInPlaceOperation(code) || node.outputs->size != 1) continue;
+    int out = node.outputs->data[0];
+    if (!lifetimes[out].needsAlloc || lifetimes[out].firstUse != i ||
+        parents.count(out)) {
+      continue;
+    }
+    // Only the data input of RESHAPE, the other one is the shape. Views of
+    // an input keep its buffer alive.
+    int numCandidates =
+        code == tflite::BuiltinOperator_RESHAPE ? 1 : node.inputs->size;
+    for (int k = 0; k < numCandidates; k++) {
+      int t = node.inputs->data[k];
+      if (t < 0 || !lifetimes[t].needsAlloc || GetLastUse(GetOwner(t)) != i ||
+          interpreter->tensor(t)->bytes != interpreter->tensor(out)->bytes) {
+        continue;
+      }
+      Share(out, GetOwner(t));
+      break;
+    }
+  }
+
+  std::map<int, int> sharedBuffers;
+  for (const auto &parent : parents) {
+    sharedBuffers[parent.first] = GetOwner(parent.first);
+  }
+  return sharedBuffers;
+}
+
+std::vector<TensorLifetime> GetBufferLifetimes(
+    const std::vector<TensorLifetime> &lifetimes,
+    const std::map<int, int> &sharedBuffers) {
+  auto bufferLifetimes = lifetimes;
+  for (const auto &shared : sharedBuffers) {
+    auto &owner = bufferLifetimes[shared.second];
+    owner.firstUse = std::min(owner.firstUse, lifetimes[shared.first].firstUse);
+    owner.lastUse = std::max(owner.lastUse, lifetimes[shared.first].lastUse);
+  }
+  return bufferLifetimes;
+}
@@ -0,0 +1,38 @@
+#ifndef OFFLINE_INTERPRETER_INPLACEPLANNING_H
+#define OFFLINE_INTERPRETER_INPLACEPLANNING_H
+
+#include <map>
+#include <vector>
+
+#include "OperatorFusion.h"
+#include "TensorPlanning.h"
+
+namespace tflite {
+class MicroInterpreter;
+}  // namespace tflite
+
+// Finds operations that leave the data of their input unchanged: RESHAPE,
+// SQUEEZE, EXPAND_DIMS and QUANTIZE without a change of type or parameters.
+// They need not run if their output shares the input's buffer. viewInputs is
+// set to the input of each of their outputs, by output tensor index.
+std::vector<bool> FindViewOperations(
+    tflite::MicroInterpreter *interpreter, const std::vector<int> &schedule,
+    const std::vector<TensorLifetime> &lifetimes,
+    std::map<int, int> *viewInputs);
+
+// Returns the tensor whose planned buffer a tensor uses, by index of the
+// tensors that do not own theirs. Views share the buffer of their input.
+// inPlace: Elementwise operations that are the last reader of an input of the
+// same size write their output into its buffer.
+std::map<int, int> PlanSharedBuffers(
+    tflite::MicroInterpreter *interpreter, const std::vector<int> &schedule,
+    const FusionPlan &fusion, const std::vector<TensorLifetime> &lifetimes,
+    const std::map<int, int> &viewInputs, bool inPlace);
+
+// Returns the lifetimes of the planned buffers, which cover the lifetimes of
+// all tensors that share them.
+std::vector<TensorLifetime> GetBufferLifetimes(
+    const std::vector<TensorLifetime> &lifetimes,
+    const std::map<int, int> &sharedBuffers);
+
+#endif
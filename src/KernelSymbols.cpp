@@ -0,0 +1,83 @@
+#include "KernelSymbols.h"
+
+namespace tflite {
+namespace ops {
+namespace micro {
+namespace activations {
+TfLiteStatus ReluEval(TfLiteContext *context, TfLiteNode *node);
+TfLiteStatus Relu6Eval(TfLiteContext *context, TfLiteNode *node);
+TfLiteStatus SoftmaxEval(TfLiteContext *context, TfLiteNode *node);
+}  // namespace activations
+namespace add {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace conv {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace depthwise_conv {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace dequantize {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace fully_connected {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace mul {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace pooling {
+TfLiteStatus AverageEval(TfLiteContext *context, TfLiteNode *node);
+TfLiteStatus MaxEval(TfLiteContext *context, TfLiteNode *node);
+}  // namespace pooling
+namespace quantize {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+namespace reshape {
+TfLiteStatus Eval(TfLiteContext *context, TfLiteNode *node);
+}
+}  // namespace micro
+}  // namespace ops
+}  // namespace tflite
+
+namespace {
+struct KernelEval {
+  TfLiteStatus (*invoke)(TfLiteContext *, TfLiteNode *);
+  KernelEvalSymbol symbol;
+};
+namespace kernels = tflite::ops::micro;
+const KernelEval kKernelEvals[] = {
+    {&kernels::activations::ReluEval, {"activations", "ReluEval"}},
+    {&kernels::activations::Relu6Eval, {"activations", "Relu6Eval"}},
+    {&kernels::activations::SoftmaxEval, {"activations", "SoftmaxEval"}},
+    {&kernels::add::Eval, {"add", "Eval"}},
+    {&kernels::conv::Eval, {"conv", "Eval"}},
+    {&kernels::depthwise_conv::Eval, {"depthwise_conv", "Eval"}},
+    {&kernels::dequantize::Eval, {"dequantize", "Eval"}},
+    {&kernels::fully_connected::Eval, {"fully_connected", "Eval"}},
+    {&kernels::mul::Eval, {"mul", "Eval"}},
+    {&kernels::pooling::AverageEval, {"pooling", "AverageEval"}},
+    {&kernels::pooling::MaxEval, {"pooling", "MaxEval"}},
+    {&kernels::quantize::Eval, {"quantize", "Eval"}},
+    {&kernels::reshape::Eval, {"reshape", "Eval"}},
+};
+}  // namespace
+
+const KernelEvalSymbol *FindKernelEvalSymbol(const TfLiteRegistration *reg) {
+  for (const auto &kernelEval : kKernelEvals) {
+    if (kernelEval.invoke == reg->invoke) {
+      return &kernelEval.symbol;
+    }
+  }
+  return nullptr;
+}
+
+std::string GetKernelEvalDeclCode(const KernelEvalSymbol &symbol) {
+  return std::string("namespace tflite { namespace ops { namespace micro { ") +
+         "namespace " + symbol.ns + " { TfLiteStatus " + symbol.name +
+         "(TfLiteContext *context, TfLiteNode *node); } } } }\n";
+}
+
+std::string GetKernelEvalName(const KernelEvalSymbol &symbol) {
+  return std::string("tflite::ops::micro::") + symbol.ns + "::" + symbol.name;
+}
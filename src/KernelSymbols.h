@@ -0,0 +1,25 @@
+#ifndef OFFLINE_INTERPRETER_KERNELSYMBOLS_H
+#define OFFLINE_INTERPRETER_KERNELSYMBOLS_H
+
+#include <string>
+
+#include "tensorflow/lite/c/common.h"
+
+// Eval function of a TFLM kernel that the target code can call by name.
+struct KernelEvalSymbol {
+  // Namespace inside of tflite::ops::micro.
+  const char *ns;
+  const char *name;
+};
+
+// Returns the symbol of reg's invoke function, or nullptr if it is not known.
+// Only functions that are the very same as in the linked TFLM are returned.
+const KernelEvalSymbol *FindKernelEvalSymbol(const TfLiteRegistration *reg);
+
+// Returns the declaration of the Eval function, to be placed at global scope.
+std::string GetKernelEvalDeclCode(const KernelEvalSymbol &symbol);
+
+// Returns the qualified name of the Eval function.
+std::string GetKernelEvalName(const KernelEvalSymbol &symbol);
+
+#endif
@@ -1,14 +1,23 @@
 #include "MemMap.h"
 
-void MemMap::record(OfflineOffset offset, size_t len, const std::string &tag) {
+#include <algorithm>
+#include <fstream>
+
+void MemMap::record(OfflineOffset offset, size_t len, const std::string &tag,
+                    int firstUse, int lastUse, bool inTimeline) {
   int off = offset.getOffset();
   if (offset.getType() == OfflineOffset::Type::Arena) {
-    m_arenaEntries.push_back({off, len, tag});
+    m_arenaEntries.push_back({off, len, tag, firstUse, lastUse, inTimeline});
   } else if (offset.getType() == OfflineOffset::Type::FB) {
-    m_constEntries.push_back({off, len, tag});
+    // Constant data is live all the time.
+    m_constEntries.push_back({off, len, tag, -1, -1, inTimeline});
   }
 }
 
+void MemMap::setOps(const std::vector<std::string> &opNames) {
+  m_opNames = opNames;
+}
+
 static void PrintBar(const std::string &label, float start, float end) {
   static const int BAR_WIDTH = 100;
   static const int TEXT_LABEL_START = 3;
@@ -82,3 +91,118 @@ void MemMap::report() const {
   }
   PrintBar("", -1.0f, -1.0f);
 }
+
+std::vector<size_t> MemMap::getLiveBytes() const {
+  // Entries add their size where they start and remove it behind their end.
+  std::vector<size_t> liveBytes(m_opNames.size());
+  std::vector<size_t> endBytes(m_opNames.size() + 1);
+  for (const auto &entry : m_arenaEntries) {
+    if (!entry.inTimeline) continue;
+    int first = std::max(entry.firstUse, 0);
+    int last = std::min(entry.lastUse, (int)liveBytes.size() - 1);
+    if (first > last) continue;
+    liveBytes[first] += entry.len;
+    endBytes[last + 1] += entry.len;
+  }
+  for (size_t op = 1; op < liveBytes.size(); op++) {
+    liveBytes[op] += liveBytes[op - 1] - endBytes[op];
+  }
+  return liveBytes;
+}
+
+int MemMap::getPeakOp(const std::vector<size_t> &liveBytes) const {
+  if (liveBytes.empty()) {
+    return -1;
+  }
+  return std::max_element(liveBytes.begin(), liveBytes.end()) -
+         liveBytes.begin();
+}
+
+static std::string GetJsonString(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+  return out + "\"";
+}
+
+static std::string GetCsvString(const std::string &s) {
+  std::string out = "\"";
+  for (char c : s) {
+    out += c == '"' ? "\"\"" : std::string(1, c);
+  }
+  return out + "\"";
+}
+
+static std::string GetJsonUse(int use) {
+  return use < 0 ? "null" : std::to_string(use);
+}
+
+bool MemMap::writeJson(const std::string &fileName) const {
+  std::ofstream out(fileName);
+  auto WriteEntries = [&](const std::vector<Entry> &entries) {
+    for (size_t i = 0; i < entries.size(); i++) {
+      const auto &entry = entries[i];
+      out << "    {\"offset\": " << entry.base << ", \"size\": " << entry.len
+          << ", \"tag\": " << GetJsonString(entry.tag)
+          << ", \"firstUse\": " << GetJsonUse(entry.firstUse)
+          << ", \"lastUse\": " << GetJsonUse(entry.lastUse)
+          << ", \"inTimeline\": " << (entry.inTimeline ? "true" : "false")
+          << "}"
+          << (i + 1 < entries.size() ? "," : "") << "\n";
+    }
+  };
+  out << "{\n";
+  out << "  \"const\": [\n";
+  WriteEntries(m_constEntries);
+  out << "  ],\n";
+  out << "  \"arena\": [\n";
+  WriteEntries(m_arenaEntries);
+  out << "  ],\n";
+  auto liveBytes = getLiveBytes();
+  out << "  \"timeline\": [\n";
+  for (size_t op = 0; op < liveBytes.size(); op++) {
+    out << "    {\"op\": " << op
+        << ", \"name\": " << GetJsonString(m_opNames[op])
+        << ", \"liveBytes\": " << liveBytes[op] << "}"
+        << (op + 1 < liveBytes.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n";
+  int peakOp = getPeakOp(liveBytes);
+  out << "  \"peakOp\": " << GetJsonUse(peakOp) << ",\n";
+  out << "  \"peakLiveBytes\": " << (peakOp < 0 ? 0 : liveBytes[peakOp])
+      << "\n";
+  out << "}\n";
+  out.close();
+  return (bool)out;
+}
+
+bool MemMap::writeCsv(const std::string &fileName) const {
+  std::ofstream out(fileName);
+  // Timeline rows use size for the live bytes and the uses for the operation.
+  out << "kind,offset,size,first_use,last_use,tag\n";
+  auto CsvUse = [](int use) { return use < 0 ? "" : std::to_string(use); };
+  for (const auto &entry : m_constEntries) {
+    out << "const," << entry.base << "," << entry.len << ","
+        << CsvUse(entry.firstUse) << "," << CsvUse(entry.lastUse) << ","
+        << GetCsvString(entry.tag) << "\n";
+  }
+  // Entries that share the memory of another one are arena_shared.
+  for (const auto &entry : m_arenaEntries) {
+    out << (entry.inTimeline ? "arena," : "arena_shared,") << entry.base
+        << "," << entry.len << "," << CsvUse(entry.firstUse) << ","
+        << CsvUse(entry.lastUse) << "," << GetCsvString(entry.tag) << "\n";
+  }
+  auto liveBytes = getLiveBytes();
+  int peakOp = getPeakOp(liveBytes);
+  for (size_t op = 0; op < liveBytes.size(); op++) {
+    out << ((int)op == peakOp ? "peak_op" : "op") << ",," << liveBytes[op]
+        << "," << op << "," << op << "," << GetCsvString(m_opNames[op])
+        << "\n";
+  }
+  out.close();
+  return (bool)out;
+}
@@ -9,17 +9,36 @@
 // Keeps track of Arena and Flatbuffer buffers and prints a summary.
 class MemMap {
  public:
-  void record(OfflineOffset offset, size_t len, const std::string &tag);
+  // firstUse, lastUse: Operations during which an arena buffer is live, -1 if
+  // unknown (e.g. constant data).
+  // inTimeline: False for entries that share the memory of another entry.
+  // They are listed, but do not add to the live bytes.
+  void record(OfflineOffset offset, size_t len, const std::string &tag,
+              int firstUse = -1, int lastUse = -1, bool inTimeline = true);
+  // Names of the model's operations, for the timeline of the reports.
+  void setOps(const std::vector<std::string> &opNames);
   void report() const;
 
+  // Writes all entries with their lifetimes, the live arena bytes per
+  // operation and the operation with the peak. Return false on write errors.
+  bool writeJson(const std::string &fileName) const;
+  bool writeCsv(const std::string &fileName) const;
+
  private:
   struct Entry {
     int base;
     size_t len;
     std::string tag;
+    int firstUse;
+    int lastUse;
+    bool inTimeline;
   };
+  std::vector<size_t> getLiveBytes() const;
+  int getPeakOp(const std::vector<size_t> &liveBytes) const;
+
   std::vector<Entry> m_constEntries;
   std::vector<Entry> m_arenaEntries;
+  std::vector<std::string> m_opNames;
 };
 
 #endif
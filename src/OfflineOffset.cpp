@@ -2,34 +2,59 @@
 
 #include <cassert>
 
-const void *OfflineOffset::arenaBase = 0;
-size_t OfflineOffset::arenaLen = 0;
-const void *OfflineOffset::fbBase = 0;
-size_t OfflineOffset::fbLen = 0;
+#include "ArenaLayout.h"
+#include "ConstData.h"
 
-void OfflineOffset::Init(void *arenaPtr, size_t arenaSz,
-                         const std::vector<char> &fb) {
-  arenaBase = arenaPtr;
-  arenaLen = arenaSz;
-  fbBase = fb.data();
-  fbLen = fb.size();
+OfflineOffsetContext::OfflineOffsetContext(void *arenaPtr, size_t arenaSz,
+                                           const std::vector<char> &fb)
+    : m_arenaBase(arenaPtr),
+      m_arenaLen(arenaSz),
+      m_fbBase(fb.data()),
+      m_fbLen(fb.size()) {}
+
+void OfflineOffsetContext::setArenaLayout(const ArenaLayout *layout) {
+  m_arenaLayout = layout;
+}
+
+void OfflineOffsetContext::setConstData(const ConstData *data) {
+  m_constData = data;
+}
+
+bool OfflineOffsetContext::isInOfflineBuffers(const void *p) const {
+  return (p >= m_arenaBase && p < ((char *)m_arenaBase + m_arenaLen)) ||
+         (p >= m_fbBase && p < ((char *)m_fbBase + m_fbLen));
 }
 
-OfflineOffset::OfflineOffset(const void *p) {
-  assert(arenaBase && "OfflineOffset not initialized!");
+bool OfflineOffsetContext::isOnTarget(const void *p) const {
+  if (p >= m_arenaBase && p < ((char *)m_arenaBase + m_arenaLen)) {
+    return !m_arenaLayout ||
+           m_arenaLayout->contains((uintptr_t)p - (uintptr_t)m_arenaBase);
+  } else if (p >= m_fbBase && p < ((char *)m_fbBase + m_fbLen)) {
+    return !m_constData ||
+           m_constData->contains((uintptr_t)p - (uintptr_t)m_fbBase);
+  }
+  return false;
+}
 
+OfflineOffset::OfflineOffset(const OfflineOffsetContext &context,
+                             const void *p)
+    : m_context(&context) {
   set(p);
 }
 
 void OfflineOffset::set(const void *p) {
+  m_relocate = false;
   if (!p) {
     m_type = Type::Null;
-  } else if (p >= arenaBase && p < ((char *)arenaBase + arenaLen)) {
+  } else if (p >= m_context->m_arenaBase &&
+             p < ((char *)m_context->m_arenaBase + m_context->m_arenaLen)) {
     m_type = Type::Arena;
-    m_offset = (uintptr_t)p - (uintptr_t)arenaBase;
-  } else if (p >= fbBase && p < ((char *)fbBase + fbLen)) {
+    m_offset = (uintptr_t)p - (uintptr_t)m_context->m_arenaBase;
+    m_relocate = true;
+  } else if (p >= m_context->m_fbBase &&
+             p < ((char *)m_context->m_fbBase + m_context->m_fbLen)) {
     m_type = Type::FB;
-    m_offset = (uintptr_t)p - (uintptr_t)fbBase;
+    m_offset = (uintptr_t)p - (uintptr_t)m_context->m_fbBase;
   } else {
     assert(false &&
            "OfflineOffset: Pointer must be in buffer that will be "
@@ -37,13 +62,35 @@ void OfflineOffset::set(const void *p) {
   }
 }
 
+void OfflineOffset::setArenaOffset(uintptr_t offset) {
+  m_type = Type::Arena;
+  m_offset = offset;
+  m_relocate = false;
+}
+
+void OfflineOffset::setFBOffset(uintptr_t offset) {
+  m_type = Type::FB;
+  m_offset = offset;
+  m_relocate = false;
+}
+
+uintptr_t OfflineOffset::getOffset() const {
+  if (m_type == Type::Arena && m_relocate && m_context->m_arenaLayout) {
+    return m_context->m_arenaLayout->relocate(m_offset);
+  }
+  if (m_type == Type::FB && m_context->m_constData) {
+    return m_context->m_constData->relocate(m_offset);
+  }
+  return m_offset;
+}
+
 std::string OfflineOffset::getPtrCode() const {
   switch (m_type) {
     case Type::Null:
       return "nullptr";
     case Type::Arena:
-      return "(tensor_arena + " + std::to_string(m_offset) + ")";
+      return "(tensor_arena + " + std::to_string(getOffset()) + ")";
     case Type::FB:
-      return "(g_model_data + " + std::to_string(m_offset) + ")";
+      return "(g_model_data + " + std::to_string(getOffset()) + ")";
   }
 }
@@ -4,31 +4,62 @@
 #include <string>
 #include <vector>
 
+class ArenaLayout;
+class ConstData;
+
+// Buffers of the model that one run generates, and how offsets in them are
+// translated to the target buffers.
+class OfflineOffsetContext {
+ public:
+  OfflineOffsetContext(void *arenaPtr, size_t arenaSz,
+                       const std::vector<char> &fb);
+
+  // Arena offsets are translated with this layout once it is set.
+  void setArenaLayout(const ArenaLayout *layout);
+  // Flatbuffer offsets are translated to this constant data once it is set.
+  void setConstData(const ConstData *data);
+
+  // Returns whether p points into the arena or flatbuffer.
+  bool isInOfflineBuffers(const void *p) const;
+  // Returns whether p points to memory that also exists on the target.
+  bool isOnTarget(const void *p) const;
+
+ private:
+  friend class OfflineOffset;
+
+  const void *m_arenaBase;
+  size_t m_arenaLen;
+  const void *m_fbBase;
+  size_t m_fbLen;
+  const ArenaLayout *m_arenaLayout = nullptr;
+  const ConstData *m_constData = nullptr;
+};
+
 // Converts offsets between the offline interpreter and the target buffers.
 class OfflineOffset {
  public:
   enum class Type { Null, Arena, FB };
 
-  static void Init(void *arenaPtr, size_t arenaSz, const std::vector<char> &fb);
-
   // p: Pointer inside of the offline interpreter.
-  explicit OfflineOffset(const void *p);
+  OfflineOffset(const OfflineOffsetContext &context, const void *p);
   void set(const void *p);
+  // Sets an offset that is already in the target arena, e.g. from the plan.
+  void setArenaOffset(uintptr_t offset);
+  // Sets an offset in the flatbuffer or one returned by ConstData::addData.
+  void setFBOffset(uintptr_t offset);
 
   // Returns a code snippet that accesses the correct pointer on the target.
   std::string getPtrCode() const;
 
   Type getType() const { return m_type; }
-  uintptr_t getOffset() const { return m_offset; }
+  uintptr_t getOffset() const;
 
  private:
-  static const void *arenaBase;
-  static size_t arenaLen;
-  static const void *fbBase;
-  static size_t fbLen;
-
+  const OfflineOffsetContext *m_context;
   uintptr_t m_offset = 0;
   Type m_type = Type::Null;
+  // Offset is in the offline interpreter's arena and needs relocation.
+  bool m_relocate = false;
 };
 
 #endif
@@ -0,0 +1,340 @@
+#include "OperatorFusion.h"
+
+#include <algorithm>
+#include <sstream>
+
+#include "TargetStructs.h"
+#include "tensorflow/lite/c/builtin_op_data.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+namespace {
+// Returns the fused activation in the builtin data of an operation, or
+// nullptr if it has none. size is set to the size of the builtin data.
+TfLiteFusedActivation *GetActivation(tflite::BuiltinOperator code,
+                                     void *builtinData, size_t *size) {
+  switch (code) {
+    case tflite::BuiltinOperator_CONV_2D:
+      *size = sizeof(TfLiteConvParams);
+      return &((TfLiteConvParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_DEPTHWISE_CONV_2D:
+      *size = sizeof(TfLiteDepthwiseConvParams);
+      return &((TfLiteDepthwiseConvParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_FULLY_CONNECTED:
+      *size = sizeof(TfLiteFullyConnectedParams);
+      return &((TfLiteFullyConnectedParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_AVERAGE_POOL_2D:
+    case tflite::BuiltinOperator_MAX_POOL_2D:
+      *size = sizeof(TfLitePoolParams);
+      return &((TfLitePoolParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_ADD:
+      *size = sizeof(TfLiteAddParams);
+      return &((TfLiteAddParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_SUB:
+      *size = sizeof(TfLiteSubParams);
+      return &((TfLiteSubParams *)builtinData)->activation;
+    case tflite::BuiltinOperator_MUL:
+      *size = sizeof(TfLiteMulParams);
+      return &((TfLiteMulParams *)builtinData)->activation;
+    default:
+      return nullptr;
+  }
+}
+
+bool SameDims(const TfLiteIntArray *a, const TfLiteIntArray *b) {
+  if (!a || !b || a->size != b->size) {
+    return false;
+  }
+  return std::equal(a->data, a->data + a->size, b->data);
+}
+
+bool SameQuantization(const TfLiteTensor *a, const TfLiteTensor *b) {
+  return a->params.scale == b->params.scale &&
+         a->params.zero_point == b->params.zero_point;
+}
+
+// Whether the activation computes the same as the fused activation of the
+// producer. Quantized RELU6 rounds its upper bound differently.
+bool CanFuseActivation(tflite::BuiltinOperator code, const TfLiteTensor *input,
+                       const TfLiteTensor *output) {
+  if (input->type != output->type || !SameDims(input->dims, output->dims)) {
+    return false;
+  }
+  if (input->type == kTfLiteFloat32) {
+    return code == tflite::BuiltinOperator_RELU ||
+           code == tflite::BuiltinOperator_RELU6;
+  }
+  return (input->type == kTfLiteInt8 || input->type == kTfLiteUInt8) &&
+         code == tflite::BuiltinOperator_RELU &&
+         SameQuantization(input, output);
+}
+
+// Builds the chain step of node, which is applied to the value in tensor
+// valueTensor. Returns false if the operation cannot be part of a chain.
+bool GetElementwiseStep(TfLiteContext *context, tflite::BuiltinOperator code,
+                        const TfLiteNode &node, int valueTensor,
+                        ElementwiseStep *step) {
+  int numInputs = 0;
+  switch (code) {
+    case tflite::BuiltinOperator_ADD:
+    case tflite::BuiltinOperator_SUB:
+    case tflite::BuiltinOperator_MUL:
+      numInputs = 2;
+      break;
+    case tflite::BuiltinOperator_RELU:
+    case tflite::BuiltinOperator_RELU6:
+      numInputs = 1;
+      break;
+    default:
+      return false;
+  }
+  if (node.inputs->size != numInputs || node.outputs->size != 1) {
+    return false;
+  }
+  const TfLiteTensor *output = &context->tensors[node.outputs->data[0]];
+  if (output->type != kTfLiteFloat32) {
+    return false;
+  }
+  // No broadcasting.
+  for (int k = 0; k < numInputs; k++) {
+    int t = node.inputs->data[k];
+    if (t < 0 || context->tensors[t].type != kTfLiteFloat32 ||
+        !SameDims(context->tensors[t].dims, output->dims)) {
+      return false;
+    }
+  }
+
+  step->code = code;
+  step->otherInput = -1;
+  step->valueFirst = true;
+  step->activationMin = 0;
+  step->activationMax = 0;
+  if (numInputs == 2) {
+    int other = node.inputs->data[0] == valueTensor ? 1 : 0;
+    if (node.inputs->data[1 - other] != valueTensor ||
+        node.inputs->data[other] == valueTensor) {
+      return false;
+    }
+    step->otherInput = node.inputs->data[other];
+    step->valueFirst = other == 1;
+
+    size_t size;
+    auto activation = *GetActivation(code, node.builtin_data, &size);
+    if (activation != kTfLiteActNone && activation != kTfLiteActRelu &&
+        activation != kTfLiteActRelu1 && activation != kTfLiteActRelu6) {
+      return false;
+    }
+    tflite::CalculateActivationRange(activation, &step->activationMin,
+                                     &step->activationMax);
+  }
+  return true;
+}
+}  // namespace
+
+void FusionPlan::applyTo(int opIndex, TfLiteNode *node) const {
+  auto it = producers.find(opIndex);
+  if (it != producers.end()) {
+    node->builtin_data = (void *)it->second.builtinData.data();
+    node->outputs = (TfLiteIntArray *)it->second.outputs.data();
+  }
+}
+
+void FusionPlan::updateLifetimes(std::vector<TensorLifetime> *lifetimes) const {
+  for (int t : removedTensors) {
+    (*lifetimes)[t].needsAlloc = false;
+  }
+  // The activation's output is written by the producer.
+  for (const auto &producer : producers) {
+    for (size_t k = 1; k < producer.second.outputs.size(); k++) {
+      auto &lifetime = (*lifetimes)[producer.second.outputs[k]];
+      lifetime.firstUse = std::min(lifetime.firstUse, producer.first);
+    }
+  }
+  // Chains run at their last operation.
+  for (const auto &chain : chains) {
+    auto &output = (*lifetimes)[chain.second.output];
+    output.firstUse = std::min(output.firstUse, chain.first);
+    auto &input = (*lifetimes)[chain.second.input];
+    input.lastUse = std::max(input.lastUse, chain.first);
+    for (const auto &step : chain.second.steps) {
+      if (step.otherInput >= 0) {
+        auto &other = (*lifetimes)[step.otherInput];
+        other.lastUse = std::max(other.lastUse, chain.first);
+      }
+    }
+  }
+}
+
+FusionPlan PlanFusion(tflite::MicroInterpreter *interpreter,
+                      const tflite::SubGraph *subgraph,
+                      const std::vector<int> &schedule, bool fuseActivations) {
+  FusionPlan plan;
+  plan.fusedOps.assign(interpreter->operators_size(), false);
+  TfLiteContext *context = GetContext(interpreter);
+
+  // Tensors that can be removed have exactly one consumer and are no output.
+  std::vector<int> numConsumers(interpreter->tensors_size());
+  std::vector<int> consumer(interpreter->tensors_size(), -1);
+  std::vector<int> producer(interpreter->tensors_size(), -1);
+  for (int i : schedule) {
+    auto node = interpreter->node_and_registration(i).node;
+    for (int k = 0; k < node.inputs->size; k++) {
+      int t = node.inputs->data[k];
+      if (t >= 0) {
+        numConsumers[t]++;
+        consumer[t] = i;
+      }
+    }
+    for (int k = 0; k < node.outputs->size; k++) {
+      producer[node.outputs->data[k]] = i;
+    }
+  }
+  for (size_t k = 0; k < subgraph->outputs()->size(); k++) {
+    numConsumers[subgraph->outputs()->Get(k)]++;
+  }
+  auto GetCode = [&](int i) {
+    return static_cast<tflite::BuiltinOperator>(
+        interpreter->node_and_registration(i).registration->builtin_code);
+  };
+  auto GetNode = [&](int i) {
+    auto node = interpreter->node_and_registration(i).node;
+    plan.applyTo(i, &node);
+    return node;
+  };
+
+  // Merge activations into their producer, which writes the activation's
+  // output directly.
+  for (int i : schedule) {
+    if (!fuseActivations) break;
+    auto code = GetCode(i);
+    auto node = GetNode(i);
+    if (node.inputs->size != 1 || node.outputs->size != 1) continue;
+    int t = node.inputs->data[0];
+    int out = node.outputs->data[0];
+    int p = t >= 0 ? producer[t] : -1;
+    if (p < 0 || numConsumers[t] != 1 ||
+        !CanFuseActivation(code, &context->tensors[t],
+                           &context->tensors[out])) {
+      continue;
+    }
+    auto producerNode = GetNode(p);
+    size_t size;
+    auto activation =
+        GetActivation(GetCode(p), producerNode.builtin_data, &size);
+    if (!activation || *activation != kTfLiteActNone ||
+        producerNode.outputs->size != 1) {
+      continue;
+    }
+    FusedProducer fused;
+    fused.builtinData.assign((char *)producerNode.builtin_data,
+                             (char *)producerNode.builtin_data + size);
+    *GetActivation(GetCode(p), fused.builtinData.data(), &size) =
+        code == tflite::BuiltinOperator_RELU ? kTfLiteActRelu
+                                             : kTfLiteActRelu6;
+    fused.outputs = {1, out};
+    plan.producers[p] = std::move(fused);
+    plan.fusedOps[i] = true;
+    plan.removedTensors.push_back(t);
+    producer[out] = p;
+  }
+
+  // Build chains from elementwise operations whose output only feeds the
+  // next one.
+  for (int i : schedule) {
+    if (plan.fusedOps[i]) continue;
+    auto node = GetNode(i);
+    ElementwiseChain chain;
+    ElementwiseStep step;
+    if (node.inputs->size < 1 ||
+        !GetElementwiseStep(context, GetCode(i), node, node.inputs->data[0],
+                            &step)) {
+      continue;
+    }
+    chain.input = node.inputs->data[0];
+    chain.ops.push_back(i);
+    chain.steps.push_back(step);
+    int value = node.outputs->data[0];
+    while (numConsumers[value] == 1) {
+      int j = consumer[value];
+      if (plan.fusedOps[j] ||
+          !GetElementwiseStep(context, GetCode(j), GetNode(j), value, &step)) {
+        break;
+      }
+      chain.ops.push_back(j);
+      chain.steps.push_back(step);
+      value = GetNode(j).outputs->data[0];
+    }
+    if (chain.ops.size() < 2) continue;
+
+    chain.output = value;
+    chain.numElements = context->tensors[value].bytes / sizeof(float);
+    for (size_t k = 0; k < chain.ops.size(); k++) {
+      int op = chain.ops[k];
+      plan.fusedOps[op] = true;
+      plan.producers.erase(op);
+      if (k + 1 < chain.ops.size()) {
+        plan.removedTensors.push_back(GetNode(op).outputs->data[0]);
+      }
+    }
+    plan.chains[chain.ops.back()] = std::move(chain);
+  }
+  return plan;
+}
+
+std::string GetElementwiseChainCode(const ElementwiseChain &chain,
+                                    const std::string &name) {
+  std::stringstream code;
+  code << "\nnamespace {\n";
+  code << "// Operations";
+  for (int op : chain.ops) {
+    code << " " << op;
+  }
+  code << " fused into one loop.\n";
+  code << "void " << name << "(TfLiteContext *ctx) {\n";
+  code << "  const float *in = ctx->tensors[" << chain.input
+       << "].data.f;\n";
+  for (size_t k = 0; k < chain.steps.size(); k++) {
+    if (chain.steps[k].otherInput >= 0) {
+      code << "  const float *in" << k << " = ctx->tensors["
+           << chain.steps[k].otherInput << "].data.f;\n";
+    }
+  }
+  code << "  float *out = ctx->tensors[" << chain.output << "].data.f;\n";
+  code << "  for (int i = 0; i < " << chain.numElements << "; i++) {\n";
+  code << "    float v = in[i];\n";
+  // Same operations and clamping as the reference kernels, so the results
+  // are bit-exact.
+  for (size_t k = 0; k < chain.steps.size(); k++) {
+    const auto &step = chain.steps[k];
+    std::string other = "in" + std::to_string(k) + "[i]";
+    switch (step.code) {
+      case tflite::BuiltinOperator_RELU:
+        code << "    v = v < 0.0f ? 0.0f : v;\n";
+        continue;
+      case tflite::BuiltinOperator_RELU6:
+        code << "    v = v > 6.0f ? 6.0f : v < 0.0f ? 0.0f : v;\n";
+        continue;
+      case tflite::BuiltinOperator_ADD:
+        code << "    v = v + " << other << ";\n";
+        break;
+      case tflite::BuiltinOperator_SUB:
+        code << "    v = "
+             << (step.valueFirst ? "v - " + other : other + " - v") << ";\n";
+        break;
+      case tflite::BuiltinOperator_MUL:
+        code << "    v = v * " << other << ";\n";
+        break;
+      default:
+        break;
+    }
+    code << "    v = v < " << GetFloatCode(step.activationMin) << " ? "
+         << GetFloatCode(step.activationMin) << " : v;\n";
+    code << "    v = " << GetFloatCode(step.activationMax) << " < v ? "
+         << GetFloatCode(step.activationMax) << " : v;\n";
+  }
+  code << "    out[i] = v;\n";
+  code << "  }\n";
+  code << "}\n";
+  code << "}  // namespace\n";
+  return code.str();
+}
@@ -0,0 +1,75 @@
+#ifndef OFFLINE_INTERPRETER_OPERATORFUSION_H
+#define OFFLINE_INTERPRETER_OPERATORFUSION_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "TensorPlanning.h"
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+namespace tflite {
+class MicroInterpreter;
+}  // namespace tflite
+
+// Producer that took over the standalone activation that followed it.
+struct FusedProducer {
+  // Copy of the producer's builtin data with the fused activation set.
+  std::vector<char> builtinData;
+  // TfLiteIntArray of the outputs (size, then tensor indices). The producer
+  // writes the activation's output.
+  std::vector<int> outputs;
+};
+
+// Step of an elementwise chain, applied to the value of the previous step.
+struct ElementwiseStep {
+  tflite::BuiltinOperator code;
+  // Other operand of binary operations, -1 for activations.
+  int otherInput;
+  // Whether the chain value is the first operand (matters for SUB).
+  bool valueFirst;
+  float activationMin;
+  float activationMax;
+};
+
+// Float elementwise operations of the same shape, where each one only feeds
+// the next. They run as one loop without storing the intermediate tensors.
+struct ElementwiseChain {
+  std::vector<int> ops;
+  int input;
+  int output;
+  int numElements;
+  std::vector<ElementwiseStep> steps;
+};
+
+struct FusionPlan {
+  // By operation index of the producer.
+  std::map<int, FusedProducer> producers;
+  // By operation index of the last operation of the chain, where it runs.
+  std::map<int, ElementwiseChain> chains;
+  // Operations that no longer run on their own.
+  std::vector<bool> fusedOps;
+  // Intermediate tensors that are no longer stored.
+  std::vector<int> removedTensors;
+
+  // Applies the changes to the builtin data and outputs of an operation's
+  // node. The node then points to data of the plan.
+  void applyTo(int opIndex, TfLiteNode *node) const;
+  // Moves the lifetimes of the tensors to where they are used now.
+  void updateLifetimes(std::vector<TensorLifetime> *lifetimes) const;
+};
+
+// Finds the fusion opportunities among the scheduled operations.
+// fuseActivations: Merge standalone RELU and RELU6 into the fused activation
+// of the producer.
+FusionPlan PlanFusion(tflite::MicroInterpreter *interpreter,
+                      const tflite::SubGraph *subgraph,
+                      const std::vector<int> &schedule, bool fuseActivations);
+
+// Returns the target code of a chain's kernel, to be placed at global scope.
+// It is called as <name>(TfLiteContext *ctx).
+std::string GetElementwiseChainCode(const ElementwiseChain &chain,
+                                    const std::string &name);
+
+#endif
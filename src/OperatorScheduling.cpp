@@ -0,0 +1,307 @@
+#include "OperatorScheduling.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#include "tensorflow/lite/core/api/flatbuffer_conversions.h"
+#include "tensorflow/lite/micro/memory_helpers.h"
+
+namespace {
+// Dependencies and tensor sizes that matter for the order of operators.
+struct ScheduleGraph {
+  int numOps;
+  // Bytes of each tensor, 0 for tensors that are not counted.
+  std::vector<size_t> tensorBytes;
+  std::vector<bool> isGraphOutput;
+  // Number of operations that read a tensor.
+  std::vector<int> numConsumers;
+  // Counted tensors that an operation reads and writes, without duplicates.
+  std::vector<std::vector<int>> opInputs;
+  std::vector<std::vector<int>> opOutputs;
+  // Operations that have to run before an operation.
+  std::vector<std::vector<int>> predecessors;
+  size_t initialLiveBytes;
+};
+
+size_t GetTensorBytes(const tflite::Tensor *tensor,
+                      tflite::ErrorReporter *errorReporter) {
+  TfLiteType type;
+  size_t typeSize;
+  if (tflite::ConvertTensorType(tensor->type(), &type, errorReporter) !=
+          kTfLiteOk ||
+      tflite::TfLiteTypeSizeOf(type, &typeSize) != kTfLiteOk) {
+    return 0;
+  }
+  size_t bytes = typeSize;
+  if (tensor->shape()) {
+    for (size_t k = 0; k < tensor->shape()->size(); k++) {
+      bytes *= tensor->shape()->Get(k);
+    }
+  }
+  return bytes;
+}
+
+ScheduleGraph BuildScheduleGraph(const tflite::Model *model,
+                                 const tflite::SubGraph *subgraph,
+                                 tflite::ErrorReporter *errorReporter) {
+  auto tensors = subgraph->tensors();
+  auto operators = subgraph->operators();
+  ScheduleGraph graph;
+  graph.numOps = operators->size();
+  graph.tensorBytes.resize(tensors->size());
+  graph.isGraphOutput.resize(tensors->size());
+  graph.numConsumers.resize(tensors->size());
+  graph.opInputs.resize(graph.numOps);
+  graph.opOutputs.resize(graph.numOps);
+  graph.predecessors.resize(graph.numOps);
+
+  // Only tensors in the arena are counted, variable tensors are allocated
+  // for the whole inference.
+  std::vector<int> producer(tensors->size(), -1);
+  for (int i = 0; i < graph.numOps; i++) {
+    for (size_t k = 0; k < operators->Get(i)->outputs()->size(); k++) {
+      producer[operators->Get(i)->outputs()->Get(k)] = i;
+    }
+  }
+  std::vector<bool> isGraphInput(tensors->size());
+  for (size_t k = 0; k < subgraph->inputs()->size(); k++) {
+    isGraphInput[subgraph->inputs()->Get(k)] = true;
+  }
+  for (size_t k = 0; k < subgraph->outputs()->size(); k++) {
+    graph.isGraphOutput[subgraph->outputs()->Get(k)] = true;
+  }
+  graph.initialLiveBytes = 0;
+  for (size_t t = 0; t < tensors->size(); t++) {
+    auto tensor = tensors->Get(t);
+    auto buffer = model->buffers()->Get(tensor->buffer());
+    bool isConst = buffer->data() && buffer->data()->size() > 0;
+    if (isConst || tensor->is_variable() ||
+        (producer[t] < 0 && !isGraphInput[t])) {
+      continue;
+    }
+    graph.tensorBytes[t] = GetTensorBytes(tensor, errorReporter);
+    if (isGraphInput[t]) graph.initialLiveBytes += graph.tensorBytes[t];
+  }
+
+  // Operations on the same variable tensor keep their order.
+  std::vector<int> lastVariableUser(tensors->size(), -1);
+  for (int i = 0; i < graph.numOps; i++) {
+    auto op = operators->Get(i);
+    auto &preds = graph.predecessors[i];
+    for (size_t k = 0; k < op->inputs()->size(); k++) {
+      int t = op->inputs()->Get(k);
+      if (t < 0) continue;
+      if (producer[t] >= 0 && producer[t] != i) preds.push_back(producer[t]);
+      if (tensors->Get(t)->is_variable()) {
+        if (lastVariableUser[t] >= 0) preds.push_back(lastVariableUser[t]);
+        lastVariableUser[t] = i;
+      }
+      auto &inputs = graph.opInputs[i];
+      if (graph.tensorBytes[t] &&
+          std::find(inputs.begin(), inputs.end(), t) == inputs.end()) {
+        inputs.push_back(t);
+        graph.numConsumers[t]++;
+      }
+    }
+    for (size_t k = 0; k < op->outputs()->size(); k++) {
+      int t = op->outputs()->Get(k);
+      if (graph.tensorBytes[t]) graph.opOutputs[i].push_back(t);
+    }
+    std::sort(preds.begin(), preds.end());
+    preds.erase(std::unique(preds.begin(), preds.end()), preds.end());
+  }
+  return graph;
+}
+
+size_t GetOutputBytes(const ScheduleGraph &graph, int op) {
+  size_t bytes = 0;
+  for (int t : graph.opOutputs[op]) bytes += graph.tensorBytes[t];
+  return bytes;
+}
+
+size_t Simulate(const ScheduleGraph &graph, const std::vector<int> &order) {
+  auto remainingConsumers = graph.numConsumers;
+  size_t liveBytes = graph.initialLiveBytes;
+  size_t peak = liveBytes;
+  for (int op : order) {
+    liveBytes += GetOutputBytes(graph, op);
+    peak = std::max(peak, liveBytes);
+    for (int t : graph.opInputs[op]) {
+      if (--remainingConsumers[t] == 0 && !graph.isGraphOutput[t]) {
+        liveBytes -= graph.tensorBytes[t];
+      }
+    }
+    for (int t : graph.opOutputs[op]) {
+      if (graph.numConsumers[t] == 0 && !graph.isGraphOutput[t]) {
+        liveBytes -= graph.tensorBytes[t];
+      }
+    }
+  }
+  return peak;
+}
+
+// Dynamic programming over the sets of operations that ran. The live bytes
+// only depend on the set, the best peak to reach a set on the order.
+std::vector<int> GetExactOrder(const ScheduleGraph &graph) {
+  int n = graph.numOps;
+  std::vector<uint32_t> predMask(n);
+  for (int i = 0; i < n; i++) {
+    for (int p : graph.predecessors[i]) predMask[i] |= 1u << p;
+  }
+  std::vector<uint32_t> consumerMask(graph.tensorBytes.size());
+  for (int i = 0; i < n; i++) {
+    for (int t : graph.opInputs[i]) consumerMask[t] |= 1u << i;
+  }
+
+  uint32_t numSets = 1u << n;
+  std::vector<size_t> best(numSets, SIZE_MAX);
+  std::vector<size_t> live(numSets);
+  std::vector<uint8_t> lastOp(numSets);
+  best[0] = live[0] = graph.initialLiveBytes;
+  for (uint32_t set = 0; set < numSets; set++) {
+    if (best[set] == SIZE_MAX) continue;
+    for (int op = 0; op < n; op++) {
+      if ((set >> op & 1) || (predMask[op] & ~set)) continue;
+      uint32_t next = set | 1u << op;
+      size_t stepBytes = live[set] + GetOutputBytes(graph, op);
+      if (best[next] == SIZE_MAX) {
+        size_t freed = 0;
+        for (int t : graph.opInputs[op]) {
+          if (!(consumerMask[t] & ~next) && !graph.isGraphOutput[t]) {
+            freed += graph.tensorBytes[t];
+          }
+        }
+        for (int t : graph.opOutputs[op]) {
+          if (!consumerMask[t] && !graph.isGraphOutput[t]) {
+            freed += graph.tensorBytes[t];
+          }
+        }
+        live[next] = stepBytes - freed;
+      }
+      size_t peak = std::max(best[set], stepBytes);
+      if (peak < best[next]) {
+        best[next] = peak;
+        lastOp[next] = op;
+      }
+    }
+  }
+
+  std::vector<int> order(n);
+  uint32_t set = numSets - 1;
+  for (int k = n - 1; k >= 0; k--) {
+    order[k] = lastOp[set];
+    set &= ~(1u << order[k]);
+  }
+  return order;
+}
+
+// Runs the ready operation next that adds the fewest live bytes, preferring
+// the flatbuffer's order on ties.
+std::vector<int> GetGreedyOrder(const ScheduleGraph &graph) {
+  int n = graph.numOps;
+  std::vector<int> numPending(n);
+  std::vector<std::vector<int>> successors(n);
+  for (int i = 0; i < n; i++) {
+    numPending[i] = graph.predecessors[i].size();
+    for (int p : graph.predecessors[i]) successors[p].push_back(i);
+  }
+  auto remainingConsumers = graph.numConsumers;
+  std::vector<bool> done(n);
+  std::vector<int> order;
+  while ((int)order.size() < n) {
+    int bestOp = -1;
+    long long bestGrowth = 0;
+    for (int op = 0; op < n; op++) {
+      if (done[op] || numPending[op]) continue;
+      long long growth = GetOutputBytes(graph, op);
+      for (int t : graph.opInputs[op]) {
+        if (remainingConsumers[t] == 1 && !graph.isGraphOutput[t]) {
+          growth -= graph.tensorBytes[t];
+        }
+      }
+      if (bestOp < 0 || growth < bestGrowth) {
+        bestOp = op;
+        bestGrowth = growth;
+      }
+    }
+    assert(bestOp >= 0 && "Operator graph has a cycle");
+    done[bestOp] = true;
+    order.push_back(bestOp);
+    for (int t : graph.opInputs[bestOp]) remainingConsumers[t]--;
+    for (int s : successors[bestOp]) numPending[s]--;
+  }
+  return order;
+}
+}  // namespace
+
+size_t GetPeakLiveBytes(const tflite::Model *model,
+                        const tflite::SubGraph *subgraph,
+                        const std::vector<int> &order,
+                        tflite::ErrorReporter *errorReporter) {
+  return Simulate(BuildScheduleGraph(model, subgraph, errorReporter), order);
+}
+
+std::vector<int> GetMemoryOrder(const tflite::Model *model,
+                                const tflite::SubGraph *subgraph,
+                                int maxExactOps,
+                                tflite::ErrorReporter *errorReporter) {
+  auto graph = BuildScheduleGraph(model, subgraph, errorReporter);
+  std::vector<int> original(graph.numOps);
+  for (int i = 0; i < graph.numOps; i++) {
+    original[i] = i;
+  }
+  // The exact search needs 17 bytes per set of operations.
+  maxExactOps = std::min(maxExactOps, 20);
+  auto order = graph.numOps <= maxExactOps ? GetExactOrder(graph)
+                                           : GetGreedyOrder(graph);
+  return Simulate(graph, order) < Simulate(graph, original) ? order : original;
+}
+
+bool IsTopologicalOrder(const tflite::Model *model,
+                        const tflite::SubGraph *subgraph,
+                        const std::vector<int> &order,
+                        tflite::ErrorReporter *errorReporter) {
+  auto graph = BuildScheduleGraph(model, subgraph, errorReporter);
+  if ((int)order.size() != graph.numOps) {
+    return false;
+  }
+  std::vector<int> position(graph.numOps, -1);
+  for (int k = 0; k < graph.numOps; k++) {
+    if (order[k] < 0 || order[k] >= graph.numOps || position[order[k]] >= 0) {
+      return false;
+    }
+    position[order[k]] = k;
+  }
+  for (int i = 0; i < graph.numOps; i++) {
+    for (int p : graph.predecessors[i]) {
+      if (position[p] > position[i]) return false;
+    }
+  }
+  return true;
+}
+
+bool ReorderOperators(const tflite::SubGraph *subgraph,
+                      const std::vector<int> &order) {
+  auto operators = subgraph->operators();
+  assert(order.size() == operators->size() && "Order must cover all ops");
+  std::vector<const uint8_t *> tables;
+  for (size_t k = 0; k < operators->size(); k++) {
+    tables.push_back(reinterpret_cast<const uint8_t *>(operators->Get(k)));
+  }
+  // Vector elements are offsets from the element to the table, which comes
+  // after the vector. Other writers may lay out the flatbuffer differently,
+  // so all elements are checked before the first one is written.
+  auto elements = const_cast<uint8_t *>(operators->Data());
+  for (size_t k = 0; k < order.size(); k++) {
+    if (tables[order[k]] <= elements + k * sizeof(flatbuffers::uoffset_t)) {
+      return false;
+    }
+  }
+  for (size_t k = 0; k < order.size(); k++) {
+    auto element = elements + k * sizeof(flatbuffers::uoffset_t);
+    flatbuffers::WriteScalar<flatbuffers::uoffset_t>(
+        element, tables[order[k]] - element);
+  }
+  return true;
+}
@@ -0,0 +1,39 @@
+#ifndef OFFLINE_INTERPRETER_OPERATORSCHEDULING_H
+#define OFFLINE_INTERPRETER_OPERATORSCHEDULING_H
+
+#include <cstddef>
+#include <vector>
+
+#include "tensorflow/lite/core/api/error_reporter.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+// Returns the peak of live tensor bytes when the operators of the subgraph
+// run in the given order. Constant and variable tensors are not counted.
+size_t GetPeakLiveBytes(const tflite::Model *model,
+                        const tflite::SubGraph *subgraph,
+                        const std::vector<int> &order,
+                        tflite::ErrorReporter *errorReporter);
+
+// Searches a topological order of the subgraph's operators with a low peak of
+// live tensor bytes. The search is exact for graphs of up to maxExactOps
+// operators, larger graphs are scheduled greedily. The result is never worse
+// than the flatbuffer's order.
+std::vector<int> GetMemoryOrder(const tflite::Model *model,
+                                const tflite::SubGraph *subgraph,
+                                int maxExactOps,
+                                tflite::ErrorReporter *errorReporter);
+
+// Returns whether order is a permutation of the subgraph's operators that
+// runs every operator after those it depends on.
+bool IsTopologicalOrder(const tflite::Model *model,
+                        const tflite::SubGraph *subgraph,
+                        const std::vector<int> &order,
+                        tflite::ErrorReporter *errorReporter);
+
+// Rewrites the operator vector of the subgraph in place, so that its k-th
+// operator is the operator order[k] of before. Returns false and leaves the
+// subgraph unchanged if its layout does not allow it.
+bool ReorderOperators(const tflite::SubGraph *subgraph,
+                      const std::vector<int> &order);
+
+#endif
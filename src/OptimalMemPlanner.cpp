@@ -1,67 +1,300 @@
 #include "OptimalMemPlanner.h"
 
+#include <algorithm>
+#include <climits>
+
+OptimalMemPlanner::OptimalMemPlanner(int timeLimitMs)
+    : m_timeLimitMs(timeLimitMs) {}
+
 TfLiteStatus OptimalMemPlanner::AddBuffer(tflite::ErrorReporter *error_reporter,
                                           int size, int first_time_used,
                                           int last_time_used) {
   m_bufferInfo.push_back(
       {(int)m_bufferInfo.size(), size, first_time_used, last_time_used});
   m_needCalc = true;
+  return kTfLiteOk;
 }
 
 size_t OptimalMemPlanner::GetMaximumMemorySize() {
   CalcIfNeeded();
-  return 0;
+  return m_maxSize;
 }
 
-int OptimalMemPlanner::GetBufferCount() { return 0; }
+int OptimalMemPlanner::GetBufferCount() { return m_bufferInfo.size(); }
 
 TfLiteStatus OptimalMemPlanner::GetOffsetForBuffer(
     tflite::ErrorReporter *error_reporter, int buffer_index, int *offset) {
   CalcIfNeeded();
+  if (buffer_index < 0 || buffer_index >= GetBufferCount()) {
+    TF_LITE_REPORT_ERROR(error_reporter,
+                         "buffer index %d is outside range 0 to %d",
+                         buffer_index, GetBufferCount());
+    return kTfLiteError;
+  }
+  *offset = m_offsets[buffer_index];
   return kTfLiteOk;
 }
 
-class AdjacencyMatrix {
- public:
-  AdjacencyMatrix(int numElems)
-      : m_buf(numElems * numElems), m_numElems(numElems) {}
+void OptimalMemPlanner::PrintMemoryPlan(tflite::ErrorReporter *error_reporter) {
+  CalcIfNeeded();
+  TF_LITE_REPORT_ERROR(error_reporter,
+                       "OptimalMemPlanner: %d buffers in %d bytes, lower bound "
+                       "%d bytes, %s after %ld search steps",
+                       GetBufferCount(), m_maxSize, m_lowerBound,
+                       m_isOptimal ? "optimal" : "time limit reached",
+                       m_numVisited);
+}
 
-  void setAdj(int i, int j) {
-    m_buf[i * m_numElems + j] = 1;
-    m_buf[j * m_numElems + i] = 1;
+static bool Overlaps(int offsetA, int sizeA, int offsetB, int sizeB) {
+  return offsetA < offsetB + sizeB && offsetB < offsetA + sizeA;
+}
+
+bool OptimalMemPlanner::IsTimeUp() {
+  // Each visit scans all buffers, so the clock is cheap in comparison.
+  m_numVisited++;
+  if (!m_timedOut) {
+    m_timedOut = std::chrono::steady_clock::now() > m_deadline;
   }
-  bool isAdj(int i, int j) const { return m_buf[i * m_numElems + j] != 0; }
+  return m_timedOut;
+}
 
- private:
-  std::vector<int> m_buf;
-  int m_numElems;
-};
+// Places the buffers in the given order, each at the lowest offset that does
+// not collide with an already placed buffer. Keeps the plan if it is better.
+void OptimalMemPlanner::PlanGreedy(const std::vector<int> &order) {
+  std::fill(m_placed.begin(), m_placed.end(), false);
+  int peak = 0;
+  for (int b : order) {
+    int size = m_bufferInfo[b].size;
+    int best = INT_MAX;
+    auto tryOffset = [&](int offset) {
+      if (offset >= best) return;
+      for (int j : m_conflicts[b]) {
+        if (m_placed[j] && Overlaps(offset, size, m_curOffsets[j],
+                                    m_bufferInfo[j].size)) {
+          return;
+        }
+      }
+      best = offset;
+    };
+    tryOffset(0);
+    for (int j : m_conflicts[b]) {
+      if (m_placed[j]) tryOffset(m_curOffsets[j] + m_bufferInfo[j].size);
+    }
+    m_curOffsets[b] = best;
+    m_placed[b] = true;
+    peak = std::max(peak, best + size);
+  }
 
-void OptimalMemPlanner::CalcIfNeeded() {
-  // Brute force plan: Try every allocation combination
-
-  // Get upper bound of time.
-  auto itMaxTime = std::max_element(
-      m_bufferInfo.begin(), m_bufferInfo.end(),
-      [](const auto &a, const auto &b) { return a.last_use < b.last_use; });
-  if (itMaxTime == m_bufferInfo.end()) {
-    // No buffers.
+  if (peak < m_maxSize) {
+    m_maxSize = peak;
+    m_offsets = m_curOffsets;
+  }
+}
+
+// Exact search over all plans in which every buffer either sits at offset 0 or
+// directly on top of a conflicting buffer. Every plan can be compacted into
+// this form without growing. Buffers are placed in order of increasing offset
+// (ties by index), so each plan is visited only once.
+void OptimalMemPlanner::Search(int lastOffset, int lastIndex, int numPlaced,
+                               int curPeak) {
+  int numBuffers = m_bufferInfo.size();
+  if (numPlaced == numBuffers) {
+    if (curPeak < m_maxSize) {
+      m_maxSize = curPeak;
+      m_offsets = m_curOffsets;
+    }
+    return;
+  }
+  if (m_maxSize == m_lowerBound || IsTimeUp()) {
     return;
   }
 
-  // Map time slots to buffers used at that time.
-  std::vector<std::vector<const BufferInfo *>> timeSlots(itMaxTime->last_use);
-  for (int i = 0; i < timeSlots.size(); i++) {
-    for (const auto &info : m_bufferInfo) {
-      if (info.first_use <= i && info.last_use >= i) {
-        timeSlots[i].push_back(&info);
+  // All buffers that are yet to be placed end up above lastOffset. At any time,
+  // they have to be stacked on top of each other and on what is already in use
+  // above lastOffset.
+  int bound = curPeak;
+  for (const auto &slot : m_timeSlots) {
+    int used = lastOffset;
+    for (int b : slot) {
+      if (!m_placed[b]) {
+        used += m_bufferInfo[b].size;
+      } else {
+        used += std::max(
+            0, m_curOffsets[b] + m_bufferInfo[b].size - lastOffset);
+      }
+    }
+    bound = std::max(bound, used);
+  }
+  if (bound >= m_maxSize) {
+    return;
+  }
+
+  struct Candidate {
+    int offset;
+    int buffer;
+  };
+  std::vector<Candidate> candidates;
+  for (int b = 0; b < numBuffers; b++) {
+    if (m_placed[b]) continue;
+    int size = m_bufferInfo[b].size;
+    auto tryOffset = [&](int offset) {
+      if (offset < lastOffset || (offset == lastOffset && b < lastIndex)) {
+        return;
+      }
+      if (offset + size >= m_maxSize) {
+        return;
       }
+      for (int j : m_conflicts[b]) {
+        if (m_placed[j] && Overlaps(offset, size, m_curOffsets[j],
+                                    m_bufferInfo[j].size)) {
+          return;
+        }
+      }
+      candidates.push_back({offset, b});
+    };
+    tryOffset(0);
+    for (int j : m_conflicts[b]) {
+      if (m_placed[j]) tryOffset(m_curOffsets[j] + m_bufferInfo[j].size);
+    }
+  }
+
+  // Try low offsets and big buffers first to find good plans early.
+  std::sort(candidates.begin(), candidates.end(),
+            [&](const Candidate &a, const Candidate &b) {
+              if (a.offset != b.offset) return a.offset < b.offset;
+              int sizeA = m_bufferInfo[a.buffer].size;
+              int sizeB = m_bufferInfo[b.buffer].size;
+              if (sizeA != sizeB) return sizeA > sizeB;
+              return a.buffer < b.buffer;
+            });
+  candidates.erase(std::unique(candidates.begin(), candidates.end(),
+                               [](const Candidate &a, const Candidate &b) {
+                                 return a.offset == b.offset &&
+                                        a.buffer == b.buffer;
+                               }),
+                   candidates.end());
+
+  for (const auto &c : candidates) {
+    m_placed[c.buffer] = true;
+    m_curOffsets[c.buffer] = c.offset;
+    Search(c.offset, c.buffer, numPlaced + 1,
+           std::max(curPeak, c.offset + m_bufferInfo[c.buffer].size));
+    m_placed[c.buffer] = false;
+    if (m_maxSize == m_lowerBound || m_timedOut) {
+      break;
+    }
+  }
+}
+
+void OptimalMemPlanner::CalcIfNeeded() {
+  if (!m_needCalc) {
+    return;
+  }
+  m_needCalc = false;
+
+  int numBuffers = m_bufferInfo.size();
+  m_offsets.assign(numBuffers, 0);
+  m_maxSize = 0;
+  m_lowerBound = 0;
+  m_isOptimal = true;
+  if (numBuffers == 0) {
+    return;
+  }
+
+  // Sweep over the buffers by first use. Every set of buffers that are live
+  // at the same time is contained in the set live when a buffer starts, and
+  // that set only needs to be kept if a buffer ends before the next start. The
+  // largest sum of sizes in a time slot is a lower bound for the arena size.
+  auto GetStart = [&](int b) { return std::max(m_bufferInfo[b].first_use, 0); };
+  std::vector<int> byStart;
+  for (int b = 0; b < numBuffers; b++) {
+    if (m_bufferInfo[b].last_use >= GetStart(b)) byStart.push_back(b);
+  }
+  std::stable_sort(byStart.begin(), byStart.end(),
+                   [&](int a, int b) { return GetStart(a) < GetStart(b); });
+  m_timeSlots.clear();
+  std::vector<int> live;
+  for (size_t k = 0; k < byStart.size();) {
+    int time = GetStart(byStart[k]);
+    live.erase(std::remove_if(live.begin(), live.end(),
+                              [&](int b) {
+                                return m_bufferInfo[b].last_use < time;
+                              }),
+               live.end());
+    for (; k < byStart.size() && GetStart(byStart[k]) == time; k++) {
+      live.push_back(byStart[k]);
+    }
+    int nextTime = k < byStart.size() ? GetStart(byStart[k]) : INT_MAX;
+    if (std::any_of(live.begin(), live.end(), [&](int b) {
+          return m_bufferInfo[b].last_use < nextTime;
+        })) {
+      m_timeSlots.push_back(live);
+    }
+  }
+  for (const auto &slot : m_timeSlots) {
+    int used = 0;
+    for (int b : slot) {
+      used += m_bufferInfo[b].size;
     }
+    m_lowerBound = std::max(m_lowerBound, used);
   }
 
-  // Build adjecancy matrix.
-  AdjacencyMatrix adjMat(m_bufferInfo.size());
-  for (const auto &info : m_bufferInfo) {
-    adjMat.setAdj(0, 0);
+  // Buffers conflict if their lifetimes overlap. A buffer conflicts with the
+  // ones that started before it and are still live.
+  std::vector<int> order(numBuffers);
+  for (int i = 0; i < numBuffers; i++) {
+    order[i] = i;
   }
+  std::vector<int> byFirstUse = order;
+  std::stable_sort(byFirstUse.begin(), byFirstUse.end(), [&](int a, int b) {
+    return m_bufferInfo[a].first_use < m_bufferInfo[b].first_use;
+  });
+  m_conflicts.assign(numBuffers, {});
+  live.clear();
+  for (int b : byFirstUse) {
+    const auto &info = m_bufferInfo[b];
+    live.erase(std::remove_if(live.begin(), live.end(),
+                              [&](int j) {
+                                return m_bufferInfo[j].last_use <
+                                       info.first_use;
+                              }),
+               live.end());
+    for (int j : live) {
+      if (info.first_use <= m_bufferInfo[j].last_use &&
+          m_bufferInfo[j].first_use <= info.last_use) {
+        m_conflicts[b].push_back(j);
+        m_conflicts[j].push_back(b);
+      }
+    }
+    live.push_back(b);
+  }
+
+  // Greedy upper bounds.
+  m_curOffsets.assign(numBuffers, 0);
+  m_placed.assign(numBuffers, false);
+  m_maxSize = INT_MAX;
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return m_bufferInfo[a].size > m_bufferInfo[b].size;
+  });
+  PlanGreedy(order);
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    const auto &infoA = m_bufferInfo[a];
+    const auto &infoB = m_bufferInfo[b];
+    return infoA.last_use - infoA.first_use > infoB.last_use - infoB.first_use;
+  });
+  PlanGreedy(order);
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return m_bufferInfo[a].first_use < m_bufferInfo[b].first_use;
+  });
+  PlanGreedy(order);
+
+  // Exact search.
+  m_deadline = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(m_timeLimitMs);
+  m_timedOut = false;
+  m_numVisited = 0;
+  std::fill(m_placed.begin(), m_placed.end(), false);
+  Search(0, -1, 0, 0);
+
+  m_isOptimal = !m_timedOut || m_maxSize == m_lowerBound;
 }
@@ -1,12 +1,21 @@
 #ifndef OFFLINE_INTERPRETER_OPTIMALMEMPLANNER_H
 #define OFFLINE_INTERPRETER_OPTIMALMEMPLANNER_H
 
+#include <chrono>
+#include <vector>
+
 #include "TensorPlanning.h"
 #include "tensorflow/lite/micro/compatibility.h"
 #include "tensorflow/lite/micro/memory_planner/memory_planner.h"
 
+// Memory planner that searches for the smallest arena that fits all buffers.
+// The offset assignment is solved with branch-and-bound, seeded with greedy
+// upper bounds and cut off by the peak of concurrently live buffers as lower
+// bound. If the time budget runs out, the best plan found so far is used.
 class OptimalMemPlanner : public tflite::MemoryPlanner {
  public:
+  explicit OptimalMemPlanner(int timeLimitMs = 10000);
+
   TfLiteStatus AddBuffer(tflite::ErrorReporter *error_reporter, int size,
                          int first_time_used, int last_time_used) override;
 
@@ -17,8 +26,15 @@ class OptimalMemPlanner : public tflite::MemoryPlanner {
   TfLiteStatus GetOffsetForBuffer(tflite::ErrorReporter *error_reporter,
                                   int buffer_index, int *offset) override;
 
+  // Prints the plan size, its lower bound, whether it is proven optimal and
+  // the number of search steps.
+  void PrintMemoryPlan(tflite::ErrorReporter *error_reporter);
+
  private:
   void CalcIfNeeded();
+  void PlanGreedy(const std::vector<int> &order);
+  void Search(int lastOffset, int lastIndex, int numPlaced, int curPeak);
+  bool IsTimeUp();
 
  private:
   bool m_needCalc = true;
@@ -29,6 +45,22 @@ class OptimalMemPlanner : public tflite::MemoryPlanner {
     int last_use;
   };
   std::vector<BufferInfo> m_bufferInfo;
+
+  // Result.
+  std::vector<int> m_offsets;
+  int m_maxSize = 0;
+  int m_lowerBound = 0;
+  bool m_isOptimal = false;
+
+  // Search state.
+  int m_timeLimitMs;
+  std::chrono::steady_clock::time_point m_deadline;
+  bool m_timedOut = false;
+  long m_numVisited = 0;
+  std::vector<std::vector<int>> m_conflicts;
+  std::vector<std::vector<int>> m_timeSlots;
+  std::vector<int> m_curOffsets;
+  std::vector<bool> m_placed;
 };
 
 #endif
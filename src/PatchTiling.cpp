@@ -0,0 +1,442 @@
+#include "PatchTiling.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+#include "tensorflow/lite/c/builtin_op_data.h"
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+namespace {
+// Rows of a tensor that an operation of the block reads or writes for a band
+// are rows band * step + offset to band * step + offset + numRows - 1.
+struct BandRows {
+  int numRows;
+  int step;
+  int offset;
+};
+
+// Shape of a convolution or pool on NHWC tensors with a batch of one.
+struct Layer {
+  int op;
+  tflite::BuiltinOperator code;
+  TfLiteNode node;
+  size_t builtinDataSize;
+  int input;
+  int output;
+  int inHeight, inWidth, inChannels;
+  int outHeight, outWidth, outChannels;
+  int strideHeight;
+  int filterHeight;
+  // Padding of the full operation.
+  int padTop;
+  int padLeft;
+  int padRight;
+  size_t elementSize;
+  // Byte that padding consists of, the zero point of quantized tensors.
+  int padByte;
+};
+
+int GetTotalPadding(TfLitePadding padding, int stride, int filter, int inSize,
+                    int outSize) {
+  if (padding != kTfLitePaddingSame) return 0;
+  return std::max((outSize - 1) * stride + filter - inSize, 0);
+}
+
+bool GetLayer(tflite::MicroInterpreter *interpreter, int op,
+              tflite::BuiltinOperator code, const TfLiteNode &node,
+              Layer *layer) {
+  if (node.inputs->size < 1 || node.outputs->size != 1 ||
+      node.inputs->data[0] < 0) {
+    return false;
+  }
+  auto input = interpreter->tensor(node.inputs->data[0]);
+  auto output = interpreter->tensor(node.outputs->data[0]);
+  if (input->dims->size != 4 || output->dims->size != 4 ||
+      input->dims->data[0] != 1 || output->dims->data[0] != 1 ||
+      input->type != output->type) {
+    return false;
+  }
+  switch (input->type) {
+    case kTfLiteFloat32:
+      layer->elementSize = 4;
+      layer->padByte = 0;
+      break;
+    case kTfLiteInt8:
+    case kTfLiteUInt8:
+      layer->elementSize = 1;
+      layer->padByte = input->params.zero_point & 0xff;
+      break;
+    default:
+      return false;
+  }
+
+  TfLitePadding padding;
+  int strideWidth, filterWidth;
+  bool isPool = false;
+  if (code == tflite::BuiltinOperator_CONV_2D ||
+      code == tflite::BuiltinOperator_DEPTHWISE_CONV_2D) {
+    if (node.inputs->size < 2 || node.inputs->data[1] < 0) return false;
+    auto filter = interpreter->tensor(node.inputs->data[1]);
+    if (filter->dims->size != 4) return false;
+    layer->filterHeight = filter->dims->data[1];
+    filterWidth = filter->dims->data[2];
+    if (code == tflite::BuiltinOperator_CONV_2D) {
+      auto params = static_cast<const TfLiteConvParams *>(node.builtin_data);
+      if (params->dilation_height_factor != 1 ||
+          params->dilation_width_factor != 1) {
+        return false;
+      }
+      padding = params->padding;
+      layer->strideHeight = params->stride_height;
+      strideWidth = params->stride_width;
+      layer->builtinDataSize = sizeof(TfLiteConvParams);
+    } else {
+      auto params =
+          static_cast<const TfLiteDepthwiseConvParams *>(node.builtin_data);
+      if (params->dilation_height_factor != 1 ||
+          params->dilation_width_factor != 1) {
+        return false;
+      }
+      padding = params->padding;
+      layer->strideHeight = params->stride_height;
+      strideWidth = params->stride_width;
+      layer->builtinDataSize = sizeof(TfLiteDepthwiseConvParams);
+    }
+  } else if (code == tflite::BuiltinOperator_AVERAGE_POOL_2D ||
+             code == tflite::BuiltinOperator_MAX_POOL_2D) {
+    auto params = static_cast<const TfLitePoolParams *>(node.builtin_data);
+    padding = params->padding;
+    layer->strideHeight = params->stride_height;
+    strideWidth = params->stride_width;
+    layer->filterHeight = params->filter_height;
+    filterWidth = params->filter_width;
+    layer->builtinDataSize = sizeof(TfLitePoolParams);
+    isPool = true;
+  } else {
+    return false;
+  }
+  if (padding != kTfLitePaddingSame && padding != kTfLitePaddingValid) {
+    return false;
+  }
+
+  layer->op = op;
+  layer->code = code;
+  layer->node = node;
+  layer->input = node.inputs->data[0];
+  layer->output = node.outputs->data[0];
+  layer->inHeight = input->dims->data[1];
+  layer->inWidth = input->dims->data[2];
+  layer->inChannels = input->dims->data[3];
+  layer->outHeight = output->dims->data[1];
+  layer->outWidth = output->dims->data[2];
+  layer->outChannels = output->dims->data[3];
+  int totalHeight =
+      GetTotalPadding(padding, layer->strideHeight, layer->filterHeight,
+                      layer->inHeight, layer->outHeight);
+  int totalWidth = GetTotalPadding(padding, strideWidth, filterWidth,
+                                   layer->inWidth, layer->outWidth);
+  // Explicit padding would take part in the pool, unlike TFLM's padding.
+  if (isPool && (totalHeight || totalWidth)) return false;
+  layer->padTop = totalHeight / 2;
+  layer->padLeft = totalWidth / 2;
+  layer->padRight = totalWidth - totalWidth / 2;
+  return true;
+}
+
+size_t AlignBytes(size_t bytes) { return (bytes + 15) & ~(size_t)15; }
+
+// Rows that each operation reads for a band of the last operation's output.
+std::vector<BandRows> GetInputRows(const std::vector<Layer> &layers,
+                                   int numTiles) {
+  std::vector<BandRows> inputRows(layers.size());
+  BandRows outputRows = {layers.back().outHeight / numTiles,
+                         layers.back().outHeight / numTiles, 0};
+  for (int k = layers.size() - 1; k >= 0; k--) {
+    const auto &layer = layers[k];
+    inputRows[k] = {(outputRows.numRows - 1) * layer.strideHeight +
+                        layer.filterHeight,
+                    outputRows.step * layer.strideHeight,
+                    outputRows.offset * layer.strideHeight - layer.padTop};
+    outputRows = inputRows[k];
+  }
+  return inputRows;
+}
+
+// Whether an input band needs explicit padding in some band.
+bool NeedsPadding(const Layer &layer, const BandRows &rows, int numTiles) {
+  return layer.padLeft || layer.padRight || rows.offset < 0 ||
+         (numTiles - 1) * rows.step + rows.offset + rows.numRows >
+             layer.inHeight;
+}
+
+size_t GetPaddedBandBytes(const Layer &layer, const BandRows &rows) {
+  return (size_t)rows.numRows *
+         (layer.padLeft + layer.inWidth + layer.padRight) * layer.inChannels *
+         layer.elementSize;
+}
+
+std::vector<size_t> GetBufferBytes(const std::vector<Layer> &layers,
+                                   const std::vector<BandRows> &inputRows,
+                                   int numTiles) {
+  std::vector<size_t> bufferBytes;
+  for (size_t k = 0; k < layers.size(); k++) {
+    // The first input band points into the input if it needs no padding.
+    bool needsBuffer =
+        k > 0 || NeedsPadding(layers[k], inputRows[k], numTiles);
+    bufferBytes.push_back(
+        needsBuffer ? GetPaddedBandBytes(layers[k], inputRows[k]) : 0);
+  }
+  return bufferBytes;
+}
+
+std::vector<size_t> GetLiveBytes(tflite::MicroInterpreter *interpreter,
+                                 const std::vector<TensorLifetime> &lifetimes) {
+  std::vector<size_t> liveBytes(interpreter->operators_size());
+  for (size_t t = 0; t < lifetimes.size(); t++) {
+    const auto &lifetime = lifetimes[t];
+    if (!lifetime.needsAlloc || lifetime.firstUse < 0) continue;
+    for (int op = lifetime.firstUse; op <= lifetime.lastUse; op++) {
+      liveBytes[op] += AlignBytes(interpreter->tensor(t)->bytes);
+    }
+  }
+  return liveBytes;
+}
+}  // namespace
+
+int TilingPlan::getTiledIndex(int opIndex) const {
+  for (size_t k = 0; k < ops.size(); k++) {
+    if (ops[k].op == opIndex) return k;
+  }
+  return -1;
+}
+
+void TilingPlan::applyTo(int opIndex, TfLiteNode *node) const {
+  int k = getTiledIndex(opIndex);
+  if (k < 0) return;
+  node->inputs = (TfLiteIntArray *)ops[k].inputs.data();
+  node->outputs = (TfLiteIntArray *)ops[k].outputs.data();
+  node->builtin_data = (void *)ops[k].builtinData.data();
+}
+
+void TilingPlan::updateLifetimes(std::vector<TensorLifetime> *lifetimes) const {
+  if (ops.empty()) return;
+  for (int t : removedTensors) {
+    (*lifetimes)[t].needsAlloc = false;
+  }
+  auto &inputLifetime = (*lifetimes)[input];
+  inputLifetime.lastUse = std::max(inputLifetime.lastUse, ops.back().op);
+  auto &outputLifetime = (*lifetimes)[output];
+  outputLifetime.firstUse = std::min(outputLifetime.firstUse, ops[0].op);
+}
+
+TilingPlan PlanTiling(tflite::MicroInterpreter *interpreter,
+                      const tflite::SubGraph *subgraph,
+                      const std::vector<int> &schedule,
+                      const FusionPlan &fusion,
+                      const std::vector<TensorLifetime> &lifetimes,
+                      const std::map<int, int> &viewInputs, int maxTiles) {
+  TilingPlan plan;
+  auto GetNode = [&](int i) {
+    auto node = interpreter->node_and_registration(i).node;
+    fusion.applyTo(i, &node);
+    return node;
+  };
+  std::vector<int> numConsumers(interpreter->tensors_size());
+  for (int i : schedule) {
+    auto node = GetNode(i);
+    for (int k = 0; k < node.inputs->size; k++) {
+      if (node.inputs->data[k] >= 0) numConsumers[node.inputs->data[k]]++;
+    }
+  }
+  for (const auto &chain : fusion.chains) {
+    numConsumers[chain.second.input]++;
+    for (const auto &step : chain.second.steps) {
+      if (step.otherInput >= 0) numConsumers[step.otherInput]++;
+    }
+  }
+  for (size_t k = 0; k < subgraph->outputs()->size(); k++) {
+    numConsumers[subgraph->outputs()->Get(k)]++;
+  }
+  // Removed views still read their input, through the buffer their output
+  // shares with it. The input must stay whole.
+  for (const auto &view : viewInputs) {
+    numConsumers[view.second]++;
+  }
+
+  // The block is a chain of consecutive operations at the start of the
+  // schedule, where each one only feeds the next.
+  std::vector<Layer> layers;
+  for (size_t k = 0; k < schedule.size(); k++) {
+    int i = schedule[k];
+    auto code = static_cast<tflite::BuiltinOperator>(
+        interpreter->node_and_registration(i).registration->builtin_code);
+    Layer layer;
+    if (fusion.chains.count(i) || (k > 0 && i != schedule[k - 1] + 1) ||
+        !GetLayer(interpreter, i, code, GetNode(i), &layer) ||
+        !lifetimes[layer.input].needsAlloc ||
+        !lifetimes[layer.output].needsAlloc ||
+        (k > 0 && (layer.input != layers.back().output ||
+                   numConsumers[layer.input] != 1))) {
+      break;
+    }
+    layers.push_back(layer);
+  }
+  if (layers.empty()) return plan;
+
+  // Pick the block length and the number of bands with the lowest peak.
+  // Shorter blocks and fewer bands win ties, they recompute less.
+  auto liveBytes = GetLiveBytes(interpreter, lifetimes);
+  size_t bestPeak = *std::max_element(liveBytes.begin(), liveBytes.end());
+  printf("tiling: peak of live tensors %lu bytes\n", bestPeak);
+  size_t bestLength = 0;
+  int bestTiles = 0;
+  for (size_t length = 1; length <= layers.size(); length++) {
+    std::vector<Layer> block(layers.begin(), layers.begin() + length);
+    int firstOp = block[0].op;
+    int lastOp = block.back().op;
+    int outHeight = block.back().outHeight;
+    for (int numTiles = 2; numTiles <= std::min(maxTiles, outHeight);
+         numTiles++) {
+      if (outHeight % numTiles) continue;
+      auto inputRows = GetInputRows(block, numTiles);
+      auto bufferBytes = GetBufferBytes(block, inputRows, numTiles);
+      auto tiledBytes = liveBytes;
+      for (size_t k = 0; k + 1 < length; k++) {
+        const auto &lifetime = lifetimes[block[k].output];
+        for (int op = lifetime.firstUse; op <= lifetime.lastUse; op++) {
+          tiledBytes[op] -=
+              AlignBytes(interpreter->tensor(block[k].output)->bytes);
+        }
+      }
+      for (int op = firstOp; op <= lastOp; op++) {
+        for (size_t bytes : bufferBytes) {
+          tiledBytes[op] += AlignBytes(bytes);
+        }
+        if (op > lifetimes[block[0].input].lastUse) {
+          tiledBytes[op] +=
+              AlignBytes(interpreter->tensor(block[0].input)->bytes);
+        }
+        if (op < lifetimes[block.back().output].firstUse) {
+          tiledBytes[op] +=
+              AlignBytes(interpreter->tensor(block.back().output)->bytes);
+        }
+      }
+      size_t peak = *std::max_element(tiledBytes.begin(), tiledBytes.end());
+      if (peak < bestPeak) {
+        bestPeak = peak;
+        bestLength = length;
+        bestTiles = numTiles;
+      }
+    }
+  }
+  if (!bestLength) return plan;
+  layers.resize(bestLength);
+  printf("tiling: operations %i to %i in %i bands, peak %lu bytes\n",
+         layers[0].op, layers.back().op, bestTiles, bestPeak);
+
+  plan.numTiles = bestTiles;
+  plan.input = layers[0].input;
+  plan.output = layers.back().output;
+  plan.firstBandTensor = interpreter->tensors_size();
+  auto inputRows = GetInputRows(layers, bestTiles);
+  plan.bufferBytes = GetBufferBytes(layers, inputRows, bestTiles);
+  for (size_t k = 0; k + 1 < layers.size(); k++) {
+    plan.removedTensors.push_back(layers[k].output);
+  }
+
+  for (size_t k = 0; k < layers.size(); k++) {
+    const auto &layer = layers[k];
+    const auto &rows = inputRows[k];
+    bool isLast = k + 1 == layers.size();
+    int outRows =
+        isLast ? layer.outHeight / bestTiles : inputRows[k + 1].numRows;
+    int inBand = plan.firstBandTensor + plan.bandTensors.size();
+    plan.bandTensors.push_back(
+        {layer.input,
+         {4, 1, rows.numRows, layer.padLeft + layer.inWidth + layer.padRight,
+          layer.inChannels},
+         GetPaddedBandBytes(layer, rows),
+         plan.bufferBytes[k] ? (int)k : -1});
+    int outBand = plan.firstBandTensor + plan.bandTensors.size();
+    plan.bandTensors.push_back(
+        {layer.output,
+         {4, 1, outRows, layer.outWidth, layer.outChannels},
+         (size_t)outRows * layer.outWidth * layer.outChannels *
+             layer.elementSize,
+         isLast ? -1 : (int)k + 1});
+
+    TiledOperation tiled;
+    tiled.op = layer.op;
+    tiled.inputs = {layer.node.inputs->size, inBand};
+    tiled.inputs.insert(tiled.inputs.end(), layer.node.inputs->data + 1,
+                        layer.node.inputs->data + layer.node.inputs->size);
+    tiled.outputs = {1, outBand};
+    tiled.builtinData.assign((char *)layer.node.builtin_data,
+                             (char *)layer.node.builtin_data +
+                                 layer.builtinDataSize);
+    // Padding is the first member of all parameters.
+    *(TfLitePadding *)tiled.builtinData.data() = kTfLitePaddingValid;
+
+    int rowBytes = layer.inWidth * layer.inChannels * layer.elementSize;
+    int pixelBytes = layer.inChannels * layer.elementSize;
+    std::string firstRow = "band * " + std::to_string(rows.step) + " + " +
+                           std::to_string(rows.offset);
+    std::string bandData =
+        "g_tensors[" + std::to_string(inBand) + "].data.raw";
+    std::stringstream code;
+    if (k == 0 && !plan.bufferBytes[0]) {
+      code << bandData << " = g_tensors[" << layer.input
+           << "].data.raw + (" << firstRow << ") * " << rowBytes << ";\n";
+    } else if (k == 0 || NeedsPadding(layer, rows, bestTiles)) {
+      // The first band is copied from the input, the others are padded where
+      // the previous operation wrote them.
+      std::string src =
+          k == 0 ? "g_tensors[" + std::to_string(layer.input) + "].data.raw"
+                 : bandData;
+      code << "PadBandRows(" << bandData << ", " << src << ", "
+           << (k == 0 ? "0" : firstRow) << ", " << firstRow << ", "
+           << rows.numRows << ", " << layer.inHeight << ", " << rowBytes
+           << ", " << layer.padLeft * pixelBytes << ", "
+           << layer.padRight * pixelBytes << ", " << layer.padByte << ");\n";
+    }
+    if (isLast) {
+      code << "g_tensors[" << outBand << "].data.raw = g_tensors["
+           << layer.output << "].data.raw + band * "
+           << plan.bandTensors.back().bytes << ";\n";
+    }
+    tiled.bandCode = code.str();
+    plan.ops.push_back(std::move(tiled));
+  }
+  return plan;
+}
+
+std::string GetTilingCode() {
+  return R"CODE(
+#include <stddef.h>
+#include <string.h>
+
+// Writes rows firstRow to firstRow + numRows - 1 of an image with height rows
+// to dst, with padLeft and padRight bytes around each row. Rows outside of
+// the image are padding. Row r of the image is at
+// src + (r - srcFirstRow) * rowBytes. Rows are moved backwards, so that dst
+// may be src.
+static void PadBandRows(char *dst, const char *src, int srcFirstRow,
+                        int firstRow, int numRows, int height, int rowBytes,
+                        int padLeft, int padRight, int padByte) {
+  int dstRowBytes = padLeft + rowBytes + padRight;
+  for (int r = numRows - 1; r >= 0; r--) {
+    char *dstRow = dst + (ptrdiff_t)r * dstRowBytes;
+    int row = firstRow + r;
+    if (row < 0 || row >= height) {
+      memset(dstRow, padByte, dstRowBytes);
+      continue;
+    }
+    const char *srcRow = src + (ptrdiff_t)(row - srcFirstRow) * rowBytes;
+    memmove(dstRow + padLeft, srcRow, rowBytes);
+    memset(dstRow, padByte, padLeft);
+    memset(dstRow + padLeft + rowBytes, padByte, padRight);
+  }
+}
+)CODE";
+}
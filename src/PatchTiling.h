@@ -0,0 +1,83 @@
+#ifndef OFFLINE_INTERPRETER_PATCHTILING_H
+#define OFFLINE_INTERPRETER_PATCHTILING_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "OperatorFusion.h"
+#include "TensorPlanning.h"
+#include "tensorflow/lite/c/common.h"
+
+namespace tflite {
+class MicroInterpreter;
+}  // namespace tflite
+
+// Tensor that holds a band of rows of a model tensor.
+struct BandTensor {
+  // Model tensor whose type and quantization the band has.
+  int source;
+  // TfLiteIntArray of the band's dims (size, then dims).
+  std::vector<int> dims;
+  size_t bytes;
+  // Band buffer that holds the data, -1 if the data pointer is set for each
+  // band.
+  int buffer;
+};
+
+// Operation of a tiled block. It runs once per band of rows, with VALID
+// padding on inputs that carry their padding explicitly.
+struct TiledOperation {
+  int op;
+  // TfLiteIntArrays of the node's tensors, with the data input and output
+  // replaced by band tensors.
+  std::vector<int> inputs;
+  std::vector<int> outputs;
+  std::vector<char> builtinData;
+  // Target code that runs before the operation for each band. It fills or
+  // points to the input band, and points to the output band of the last
+  // operation.
+  std::string bandCode;
+};
+
+// Leading block of convolutions and pools that runs band by band, so that
+// only bands of its intermediate tensors are live.
+struct TilingPlan {
+  int numTiles = 0;
+  std::vector<TiledOperation> ops;
+  // Data input of the first and output of the last operation.
+  int input = -1;
+  int output = -1;
+  // Band tensors have the indices behind the model's tensors.
+  int firstBandTensor = 0;
+  std::vector<BandTensor> bandTensors;
+  std::vector<size_t> bufferBytes;
+  // Intermediate tensors that are no longer stored.
+  std::vector<int> removedTensors;
+
+  // Returns the position of the operation in the block, or -1.
+  int getTiledIndex(int opIndex) const;
+  // Points the node to the band tensors and the builtin data of the plan.
+  void applyTo(int opIndex, TfLiteNode *node) const;
+  // The input and output of the block are live during all of it.
+  void updateLifetimes(std::vector<TensorLifetime> *lifetimes) const;
+};
+
+// Finds the leading block of the schedule and the number of bands with the
+// lowest peak of live arena bytes. Returns an empty plan if tiling does not
+// lower the peak.
+// viewInputs: Input of each removed view operation by its output, as found by
+// FindViewOperations.
+// maxTiles: Upper bound of the number of bands, which bounds the recompute of
+// overlapping rows.
+TilingPlan PlanTiling(tflite::MicroInterpreter *interpreter,
+                      const tflite::SubGraph *subgraph,
+                      const std::vector<int> &schedule,
+                      const FusionPlan &fusion,
+                      const std::vector<TensorLifetime> &lifetimes,
+                      const std::map<int, int> &viewInputs, int maxTiles);
+
+// Returns the target code of the band helpers, to be placed at global scope.
+std::string GetTilingCode();
+
+#endif
@@ -0,0 +1,142 @@
+#include "PlanCache.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+// Bump when the entry format or the meaning of its contents changes.
+static const int kPlanCacheVersion = 1;
+static const char *const kPlanCacheMagic = "offline-interpreter-plan";
+
+// FNV-1a, good enough to tell models and option sets apart.
+static uint64_t GetHash(const char *data, size_t len, uint64_t hash) {
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+std::string GetPlanCacheFile(const std::string &cacheDir,
+                             const std::vector<char> &modelData,
+                             const std::string &optionsKey) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  hash = GetHash(modelData.data(), modelData.size(), hash);
+  hash = GetHash(optionsKey.data(), optionsKey.size(), hash);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.plan", (unsigned long long)hash);
+  return cacheDir + "/" + name;
+}
+
+bool LoadCachedPlan(const std::string &fileName, CachedPlan *plan) {
+  std::ifstream in(fileName);
+  std::string magic;
+  int version = 0;
+  if (!(in >> magic >> version) || magic != kPlanCacheMagic ||
+      version != kPlanCacheVersion) {
+    return false;
+  }
+  CachedPlan loaded;
+  size_t numOps = 0;
+  size_t numBuffers = 0;
+  in >> loaded.tfliteArenaSize >> numOps;
+  loaded.operatorOrder.resize(numOps);
+  for (auto &op : loaded.operatorOrder) {
+    in >> op;
+  }
+  in >> numBuffers;
+  loaded.buffers.resize(numBuffers);
+  for (auto &buffer : loaded.buffers) {
+    in >> buffer.size >> buffer.firstUse >> buffer.lastUse >> buffer.offset;
+  }
+  in >> loaded.plannedSize;
+  if (!in) {
+    return false;
+  }
+  *plan = loaded;
+  return true;
+}
+
+bool SaveCachedPlan(const std::string &fileName, const CachedPlan &plan) {
+  std::stringstream tmpName;
+  tmpName << fileName << ".tmp" << std::this_thread::get_id();
+  {
+    std::ofstream out(tmpName.str());
+    out << kPlanCacheMagic << " " << kPlanCacheVersion << "\n";
+    out << plan.tfliteArenaSize << "\n";
+    out << plan.operatorOrder.size();
+    for (int op : plan.operatorOrder) {
+      out << " " << op;
+    }
+    out << "\n" << plan.buffers.size() << "\n";
+    for (const auto &buffer : plan.buffers) {
+      out << buffer.size << " " << buffer.firstUse << " " << buffer.lastUse
+          << " " << buffer.offset << "\n";
+    }
+    out << plan.plannedSize << "\n";
+    if (!out) {
+      return false;
+    }
+  }
+  return std::rename(tmpName.str().c_str(), fileName.c_str()) == 0;
+}
+
+CachedMemPlanner::CachedMemPlanner(tflite::MemoryPlanner *planner,
+                                   const CachedPlan &cached)
+    : m_planner(planner), m_cached(cached) {}
+
+TfLiteStatus CachedMemPlanner::AddBuffer(tflite::ErrorReporter *error_reporter,
+                                         int size, int first_time_used,
+                                         int last_time_used) {
+  m_buffers.push_back({size, first_time_used, last_time_used, 0});
+  m_checked = false;
+  return m_planner->AddBuffer(error_reporter, size, first_time_used,
+                              last_time_used);
+}
+
+bool CachedMemPlanner::isCacheHit() {
+  if (m_checked) {
+    return m_hit;
+  }
+  m_checked = true;
+  m_hit = !m_buffers.empty() && m_buffers.size() == m_cached.buffers.size();
+  for (size_t i = 0; i < m_buffers.size() && m_hit; i++) {
+    const auto &a = m_buffers[i];
+    const auto &b = m_cached.buffers[i];
+    m_hit = a.size == b.size && a.firstUse == b.firstUse &&
+            a.lastUse == b.lastUse;
+  }
+  return m_hit;
+}
+
+size_t CachedMemPlanner::GetMaximumMemorySize() {
+  return isCacheHit() ? m_cached.plannedSize
+                      : m_planner->GetMaximumMemorySize();
+}
+
+int CachedMemPlanner::GetBufferCount() { return m_buffers.size(); }
+
+TfLiteStatus CachedMemPlanner::GetOffsetForBuffer(
+    tflite::ErrorReporter *error_reporter, int buffer_index, int *offset) {
+  if (!isCacheHit()) {
+    return m_planner->GetOffsetForBuffer(error_reporter, buffer_index, offset);
+  }
+  if (buffer_index < 0 || buffer_index >= GetBufferCount()) {
+    TF_LITE_REPORT_ERROR(error_reporter,
+                         "buffer index %d is outside range 0 to %d",
+                         buffer_index, GetBufferCount());
+    return kTfLiteError;
+  }
+  *offset = m_cached.buffers[buffer_index].offset;
+  return kTfLiteOk;
+}
+
+void CachedMemPlanner::storePlan(tflite::ErrorReporter *error_reporter,
+                                 CachedPlan *plan) {
+  plan->buffers = m_buffers;
+  for (int i = 0; i < GetBufferCount(); i++) {
+    GetOffsetForBuffer(error_reporter, i, &plan->buffers[i].offset);
+  }
+  plan->plannedSize = GetMaximumMemorySize();
+}
@@ -0,0 +1,70 @@
+#ifndef OFFLINE_INTERPRETER_PLANCACHE_H
+#define OFFLINE_INTERPRETER_PLANCACHE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "tensorflow/lite/micro/memory_planner/memory_planner.h"
+
+// Buffer of a memory plan, with the lifetime it was requested with.
+struct PlanBuffer {
+  int size;
+  int firstUse;
+  int lastUse;
+  int offset;
+};
+
+// Results of the expensive generation steps for one model and set of
+// options. Empty members were not computed.
+struct CachedPlan {
+  size_t tfliteArenaSize = 0;
+  std::vector<int> operatorOrder;
+  std::vector<PlanBuffer> buffers;
+  size_t plannedSize = 0;
+};
+
+// Returns the file name of the cache entry in cacheDir for the model bytes
+// and a string of all options that influence generation.
+std::string GetPlanCacheFile(const std::string &cacheDir,
+                             const std::vector<char> &modelData,
+                             const std::string &optionsKey);
+
+// Returns false if there is no entry or it has another format version.
+bool LoadCachedPlan(const std::string &fileName, CachedPlan *plan);
+// Writes to a temporary file first, so concurrent runs never read a partial
+// entry.
+bool SaveCachedPlan(const std::string &fileName, const CachedPlan &plan);
+
+// Memory planner that takes the offsets of a cached plan if exactly the same
+// buffers are requested. Otherwise the buffers are planned by another planner,
+// which only computes its plan on demand.
+class CachedMemPlanner : public tflite::MemoryPlanner {
+ public:
+  CachedMemPlanner(tflite::MemoryPlanner *planner, const CachedPlan &cached);
+
+  TfLiteStatus AddBuffer(tflite::ErrorReporter *error_reporter, int size,
+                         int first_time_used, int last_time_used) override;
+
+  size_t GetMaximumMemorySize() override;
+
+  int GetBufferCount() override;
+
+  TfLiteStatus GetOffsetForBuffer(tflite::ErrorReporter *error_reporter,
+                                  int buffer_index, int *offset) override;
+
+  // Whether the cached plan is used. Valid once all buffers were added.
+  bool isCacheHit();
+  // Stores the buffers with their offsets and the plan size in plan.
+  void storePlan(tflite::ErrorReporter *error_reporter, CachedPlan *plan);
+
+ private:
+  tflite::MemoryPlanner *m_planner;
+  const CachedPlan &m_cached;
+  std::vector<PlanBuffer> m_buffers;
+  // The buffers are compared once after the last one was added.
+  bool m_checked = false;
+  bool m_hit = false;
+};
+
+#endif
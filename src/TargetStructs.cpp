@@ -0,0 +1,101 @@
+#include "TargetStructs.h"
+
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+namespace {
+struct StructLayout {
+  const char *name;
+  // Leading members in the order they are initialized in the target code.
+  std::vector<const char *> members;
+};
+const StructLayout kStructLayouts[] = {
+    {"TfLiteIntArray", {"size", "data"}},
+    {"TfLiteFloatArray", {"size", "data"}},
+    {"TfLiteQuantizationParams", {"scale", "zero_point"}},
+    {"TfLiteQuantization", {"type", "params"}},
+    {"TfLiteAffineQuantization",
+     {"scale", "zero_point", "quantized_dimension"}},
+    {"TfLiteTensor",
+     {"type", "data", "dims", "params", "allocation_type", "bytes",
+      "allocation", "name", "delegate", "buffer_handle", "data_is_stale",
+      "is_variable", "quantization"}},
+    {"TfLiteNode",
+     {"inputs", "outputs", "intermediates", "temporaries", "user_data",
+      "builtin_data", "custom_initial_data", "custom_initial_data_size",
+      "delegate"}},
+};
+}  // namespace
+
+std::string GetStructLayoutCheckCode() {
+  std::stringstream out;
+  out << "// Checks that members directly follow each other, as expected by "
+         "the\n// initializers below.\n";
+  out << "#define TFLM_OFFLINE_MEMBER(T, m) (((T *)nullptr)->m)\n";
+  out << "#define TFLM_OFFLINE_CHECK_NEXT(T, a, b)                            "
+         "\\\n"
+         "  static_assert(offsetof(T, b) ==                                   "
+         "\\\n"
+         "                    ((offsetof(T, a) + sizeof(TFLM_OFFLINE_MEMBER(T, "
+         "a)) + \\\n"
+         "                      alignof(decltype(TFLM_OFFLINE_MEMBER(T, b))) - "
+         "1) &  \\\n"
+         "                     ~(alignof(decltype(TFLM_OFFLINE_MEMBER(T, b))) "
+         "- 1)), \\\n"
+         "                \"Unexpected layout of \" #T)\n";
+  for (const auto &layout : kStructLayouts) {
+    out << "static_assert(offsetof(" << layout.name << ", "
+        << layout.members[0] << ") == 0, \"Unexpected layout of "
+        << layout.name << "\");\n";
+    for (size_t i = 1; i < layout.members.size(); i++) {
+      out << "TFLM_OFFLINE_CHECK_NEXT(" << layout.name << ", "
+          << layout.members[i - 1] << ", " << layout.members[i] << ");\n";
+    }
+  }
+  out << "#undef TFLM_OFFLINE_CHECK_NEXT\n";
+  out << "#undef TFLM_OFFLINE_MEMBER\n";
+  return out.str();
+}
+
+std::string GetFloatCode(float v) {
+  if (std::isnan(v)) {
+    return "__builtin_nanf(\"\")";
+  } else if (std::isinf(v)) {
+    return v > 0 ? "__builtin_inff()" : "-__builtin_inff()";
+  }
+  std::stringstream out;
+  out.precision(std::numeric_limits<float>::max_digits10);
+  out << v;
+  auto code = out.str();
+  if (code.find_first_of(".e") == std::string::npos) {
+    code += ".0";
+  }
+  return code + "f";
+}
+
+const char *GetTypeCode(TfLiteType type) {
+  switch (type) {
+    case kTfLiteFloat32:
+      return "float";
+    case kTfLiteInt32:
+      return "int32_t";
+    case kTfLiteUInt8:
+      return "uint8_t";
+    case kTfLiteInt64:
+      return "int64_t";
+    case kTfLiteBool:
+      return "bool";
+    case kTfLiteInt16:
+      return "int16_t";
+    case kTfLiteComplex64:
+      return "TfLiteComplex64";
+    case kTfLiteInt8:
+      return "int8_t";
+    case kTfLiteFloat16:
+      return "TfLiteFloat16";
+    default:
+      return "void";
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef OFFLINE_INTERPRETER_TARGETSTRUCTS_H
+#define OFFLINE_INTERPRETER_TARGETSTRUCTS_H
+
+#include <string>
+
+#include "tensorflow/lite/c/common.h"
+
+// The target code initializes TfLite structs with aggregate initializers,
+// which depend on the order of the struct members. Returns static_asserts that
+// check that the members are laid out in that order without gaps on the
+// target. Works on any ABI, only the order is checked, not the offsets.
+std::string GetStructLayoutCheckCode();
+
+// Returns a float literal that exactly represents v.
+std::string GetFloatCode(float v);
+
+// Returns the C type of tensor elements of the given type, or "void" if
+// there is none.
+const char *GetTypeCode(TfLiteType type);
+
+#endif
@@ -0,0 +1,35 @@
+#include "TensorNames.h"
+
+#include "tensorflow/lite/micro/micro_interpreter.h"
+
+std::vector<std::string> GetTensorNames(
+    const tflite::MicroInterpreter &interpreter) {
+  std::vector<std::string> tensorNames;
+  for (int i = 0; i < interpreter.tensors_size(); i++) {
+    tensorNames.push_back("T" + std::to_string(i) + "_");
+  }
+
+  // Names list the first uses of a tensor, so that tensors shared by many
+  // operations do not get huge names.
+  const int kMaxNamedUses = 8;
+  std::vector<int> numUses(interpreter.tensors_size());
+  auto AddUses = [&](const TfLiteIntArray *tensorArray, int opIndex,
+                     const char *kind) {
+    if (!tensorArray) return;
+    for (int k = 0; k < tensorArray->size; k++) {
+      int t = tensorArray->data[k];
+      if (t < 0 || ++numUses[t] > kMaxNamedUses) continue;
+      tensorNames[t] += "L" + std::to_string(opIndex) + kind;
+    }
+  };
+  auto nOps = interpreter.operators_size();
+  for (int i = 0; i < nOps; i++) {
+    auto nodeAndReg = interpreter.node_and_registration(i);
+    auto node = &nodeAndReg.node;
+    AddUses(node->inputs, i, "IN");
+    AddUses(node->outputs, i, "OUT");
+    AddUses(node->intermediates, i, "INT");
+    AddUses(node->temporaries, i, "TMP");
+  }
+  return tensorNames;
+}
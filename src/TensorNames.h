@@ -0,0 +1,16 @@
+#ifndef OFFLINE_INTERPRETER_TENSORNAMES_H
+#define OFFLINE_INTERPRETER_TENSORNAMES_H
+
+#include <string>
+#include <vector>
+
+namespace tflite {
+class MicroInterpreter;
+}  // namespace tflite
+
+// Returns the names of the tensors in the generated code. They consist of the
+// tensor index and the first operations that use the tensor, e.g. T3_L2OUTL3IN.
+std::vector<std::string> GetTensorNames(
+    const tflite::MicroInterpreter &interpreter);
+
+#endif
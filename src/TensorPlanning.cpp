@@ -219,13 +219,18 @@ std::vector<TensorLifetime> GetTensorLifetimes(
   auto subgraph = interpreter->subgraph_;
 
   auto numTensors = subgraph->tensors()->size();
+  auto numScratchBuffers = interpreter->allocator_.scratch_buffer_count_;
 
-  std::vector<uint8_t> buf(1024);
+  // The allocation info of all tensors and scratch buffers is the only
+  // allocation.
+  std::vector<uint8_t> buf(
+      sizeof(tflite::AllocationInfo) * (numTensors + numScratchBuffers) +
+      alignof(tflite::AllocationInfo));
   tflite::SimpleMemoryAllocator allocator(error_reporter, buf.data(),
                                           buf.size());
 
   tflite::AllocationInfoBuilder builder(error_reporter, &allocator);
-  builder.Init(numTensors, interpreter->allocator_.scratch_buffer_count_);
+  builder.Init(numTensors, numScratchBuffers);
   builder.AddTensors(subgraph, interpreter->context_.tensors);
   builder.AddScratchBuffers(interpreter->allocator_.scratch_buffer_handles_);
   auto allocInfo = builder.Finish();
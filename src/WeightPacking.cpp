@@ -0,0 +1,212 @@
+#include "WeightPacking.h"
+
+#include <algorithm>
+
+#include "tensorflow/lite/c/builtin_op_data.h"
+#include "tensorflow/lite/kernels/internal/quantization_util.h"
+#include "tensorflow/lite/kernels/kernel_util.h"
+
+namespace {
+constexpr int kInputTensor = 0;
+constexpr int kWeightsTensor = 1;
+constexpr int kBiasTensor = 2;
+
+int GetFlatSize(const TfLiteIntArray *dims) {
+  int size = 1;
+  for (int i = 0; i < dims->size; i++) {
+    size *= dims->data[i];
+  }
+  return size;
+}
+
+const TfLiteAffineQuantization *GetAffineQuantization(
+    const TfLiteTensor *tensor) {
+  if (tensor->quantization.type != kTfLiteAffineQuantization) {
+    return nullptr;
+  }
+  return (const TfLiteAffineQuantization *)tensor->quantization.params;
+}
+}  // namespace
+
+bool PackLayer(TfLiteContext *context, tflite::BuiltinOperator code,
+               const TfLiteNode *node, PackedLayer *packed) {
+  if (node->inputs->size < 2 || node->outputs->size != 1) {
+    return false;
+  }
+  int biasIndex = node->inputs->size > kBiasTensor
+                      ? node->inputs->data[kBiasTensor]
+                      : kTfLiteOptionalTensor;
+  const TfLiteTensor *input =
+      &context->tensors[node->inputs->data[kInputTensor]];
+  const TfLiteTensor *weights =
+      &context->tensors[node->inputs->data[kWeightsTensor]];
+  const TfLiteTensor *bias = biasIndex == kTfLiteOptionalTensor
+                                 ? nullptr
+                                 : &context->tensors[biasIndex];
+  TfLiteTensor *output = &context->tensors[node->outputs->data[0]];
+  if (input->type != kTfLiteInt8 || weights->type != kTfLiteInt8 ||
+      output->type != kTfLiteInt8 || (bias && bias->type != kTfLiteInt32) ||
+      weights->allocation_type != kTfLiteMmapRo ||
+      (bias && bias->allocation_type != kTfLiteMmapRo)) {
+    return false;
+  }
+  auto weightsQuant = GetAffineQuantization(weights);
+  if (!weightsQuant) {
+    return false;
+  }
+  for (int i = 0; i < weightsQuant->zero_point->size; i++) {
+    if (weightsQuant->zero_point->data[i] != 0) {
+      return false;
+    }
+  }
+
+  // Both are a multiplication of rows of the input with the weights matrix.
+  TfLiteFusedActivation activation;
+  const TfLiteIntArray *weightsDims = weights->dims;
+  if (code == tflite::BuiltinOperator_FULLY_CONNECTED) {
+    auto params = (const TfLiteFullyConnectedParams *)node->builtin_data;
+    if (params->weights_format != kTfLiteFullyConnectedWeightsFormatDefault ||
+        weightsDims->size != 2 || weightsQuant->scale->size != 1) {
+      return false;
+    }
+    activation = params->activation;
+  } else if (code == tflite::BuiltinOperator_CONV_2D) {
+    auto params = (const TfLiteConvParams *)node->builtin_data;
+    if (params->stride_width != 1 || params->stride_height != 1 ||
+        weightsDims->size != 4 || weightsDims->data[1] != 1 ||
+        weightsDims->data[2] != 1 || input->dims->size != 4 ||
+        output->dims->size != 4 ||
+        input->dims->data[1] != output->dims->data[1] ||
+        input->dims->data[2] != output->dims->data[2]) {
+      return false;
+    }
+    activation = params->activation;
+  } else {
+    return false;
+  }
+  int outputDepth = weightsDims->data[0];
+  int accumDepth = weightsDims->data[weightsDims->size - 1];
+  int numRows = GetFlatSize(output->dims) / outputDepth;
+  if (numRows * accumDepth != GetFlatSize(input->dims) ||
+      (weightsQuant->scale->size != 1 &&
+       weightsQuant->scale->size != outputDepth)) {
+    return false;
+  }
+
+  packed->inputIndex = node->inputs->data[kInputTensor];
+  packed->outputIndex = node->outputs->data[0];
+  packed->numRows = numRows;
+  packed->accumDepth = accumDepth;
+  packed->outputDepth = outputDepth;
+  packed->outputOffset = output->params.zero_point;
+  if (tflite::CalculateActivationRangeQuantized(
+          context, activation, output, &packed->activationMin,
+          &packed->activationMax) != kTfLiteOk) {
+    return false;
+  }
+
+  int paddedDepth =
+      (outputDepth + kPackedLayerBlock - 1) / kPackedLayerBlock *
+      kPackedLayerBlock;
+  int32_t inputOffset = -input->params.zero_point;
+  packed->weights.assign(paddedDepth * accumDepth, 0);
+  packed->bias.assign(paddedDepth, 0);
+  packed->outputMultipliers.assign(paddedDepth, 0);
+  packed->outputShifts.assign(paddedDepth, 0);
+  for (int o = 0; o < outputDepth; o++) {
+    const int8_t *row = weights->data.int8 + o * accumDepth;
+    int8_t *block = &packed->weights[o / kPackedLayerBlock *
+                                     kPackedLayerBlock * accumDepth];
+    int32_t rowSum = 0;
+    for (int d = 0; d < accumDepth; d++) {
+      block[d * kPackedLayerBlock + o % kPackedLayerBlock] = row[d];
+      rowSum += row[d];
+    }
+    packed->bias[o] = (bias ? bias->data.i32[o] : 0) + inputOffset * rowSum;
+
+    // Rounded like the kernels of TFLM: fully connected multiplies the input
+    // and weights scales in float (GetQuantizedConvolutionMultipler), the
+    // per channel convolution path only in double.
+    float weightsScale =
+        weightsQuant->scale->data[weightsQuant->scale->size == 1 ? 0 : o];
+    double outputScale;
+    if (code == tflite::BuiltinOperator_FULLY_CONNECTED) {
+      outputScale = (double)(input->params.scale * weightsScale) /
+                    (double)output->params.scale;
+    } else {
+      outputScale = (double)input->params.scale * (double)weightsScale /
+                    (double)output->params.scale;
+    }
+    int shift;
+    tflite::QuantizeMultiplier(outputScale, &packed->outputMultipliers[o],
+                               &shift);
+    packed->outputShifts[o] = shift;
+  }
+  return true;
+}
+
+std::vector<int> GetPackedTensors(const TfLiteNode *node) {
+  std::vector<int> tensors = {node->inputs->data[kWeightsTensor]};
+  if (node->inputs->size > kBiasTensor &&
+      node->inputs->data[kBiasTensor] != kTfLiteOptionalTensor) {
+    tensors.push_back(node->inputs->data[kBiasTensor]);
+  }
+  return tensors;
+}
+
+static_assert(kPackedLayerBlock == 4, "Kernel code is written for 4");
+
+std::string GetPackedLayerKernelCode() {
+  return R"CODE(
+#include "tensorflow/lite/kernels/internal/common.h"
+
+namespace {
+// Layer whose int8 weights were packed offline. Weights of 4 output channels
+// are interleaved and the input offset is folded into the bias.
+struct PackedLayerParams {
+  int inputIndex;
+  int outputIndex;
+  int numRows;
+  int accumDepth;
+  int outputDepth;
+  const int8_t *weights;
+  const int32_t *bias;
+  const int32_t *outputMultipliers;
+  const int32_t *outputShifts;
+  int32_t outputOffset;
+  int32_t activationMin;
+  int32_t activationMax;
+};
+
+void EvalPackedLayer(TfLiteContext *ctx, const PackedLayerParams &p) {
+  const int8_t *input = ctx->tensors[p.inputIndex].data.int8;
+  int8_t *output = ctx->tensors[p.outputIndex].data.int8;
+  for (int row = 0; row < p.numRows; row++) {
+    const int8_t *in = input + row * p.accumDepth;
+    int8_t *out = output + row * p.outputDepth;
+    const int8_t *w = p.weights;
+    for (int o = 0; o < p.outputDepth; o += 4) {
+      int32_t acc[4] = {p.bias[o], p.bias[o + 1], p.bias[o + 2],
+                        p.bias[o + 3]};
+      for (int d = 0; d < p.accumDepth; d++, w += 4) {
+        int32_t x = in[d];
+        acc[0] += w[0] * x;
+        acc[1] += w[1] * x;
+        acc[2] += w[2] * x;
+        acc[3] += w[3] * x;
+      }
+      int n = p.outputDepth - o < 4 ? p.outputDepth - o : 4;
+      for (int k = 0; k < n; k++) {
+        int32_t v = tflite::MultiplyByQuantizedMultiplier(
+            acc[k], p.outputMultipliers[o + k], p.outputShifts[o + k]);
+        v += p.outputOffset;
+        v = v < p.activationMin ? p.activationMin : v;
+        v = v > p.activationMax ? p.activationMax : v;
+        out[o + k] = (int8_t)v;
+      }
+    }
+  }
+}
+}  // namespace
+)CODE";
+}
@@ -0,0 +1,47 @@
+#ifndef OFFLINE_INTERPRETER_WEIGHTPACKING_H
+#define OFFLINE_INTERPRETER_WEIGHTPACKING_H
+
+#include <string>
+#include <vector>
+
+#include "tensorflow/lite/c/common.h"
+#include "tensorflow/lite/schema/schema_generated.h"
+
+// Number of output channels whose weights are interleaved.
+constexpr int kPackedLayerBlock = 4;
+
+// Int8 matrix multiplication layer (fully connected or 1x1 convolution) whose
+// weights are packed offline for the kernel of GetPackedLayerKernelCode().
+struct PackedLayer {
+  int inputIndex;
+  int outputIndex;
+  // Rows of the multiplication, e.g. batches or pixels.
+  int numRows;
+  int accumDepth;
+  int outputDepth;
+  // Weights of kPackedLayerBlock output channels are interleaved, so that
+  // every input value is loaded once per block. Padded with zero weights.
+  std::vector<int8_t> weights;
+  // Per output channel, padded. The input offset is folded into the bias.
+  std::vector<int32_t> bias;
+  std::vector<int32_t> outputMultipliers;
+  std::vector<int32_t> outputShifts;
+  int32_t outputOffset;
+  int32_t activationMin;
+  int32_t activationMax;
+};
+
+// Packs the weights of node. Returns false if the operation or its
+// configuration is not supported by the packed kernel.
+bool PackLayer(TfLiteContext *context, tflite::BuiltinOperator code,
+               const TfLiteNode *node, PackedLayer *packed);
+
+// Returns the target code of the PackedLayerParams struct and the
+// EvalPackedLayer kernel, to be placed at global scope.
+std::string GetPackedLayerKernelCode();
+
+// Returns the weights and bias tensors of a packed node. The target no longer
+// needs their data.
+std::vector<int> GetPackedTensors(const TfLiteNode *node);
+
+#endif
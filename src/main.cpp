@@ -1,15 +1,37 @@
+#include <dirent.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <map>
-#include <regex>
 #include <set>
 #include <sstream>
+#include <thread>
 
+#include "ArenaLayout.h"
+#include "ConstData.h"
+#include "InPlacePlanning.h"
+#include "KernelSymbols.h"
 #include "MemMap.h"
 #include "OfflineOffset.h"
+#include "OperatorFusion.h"
+#include "OperatorScheduling.h"
+#include "OptimalMemPlanner.h"
+#include "PatchTiling.h"
+#include "PlanCache.h"
+#include "TargetStructs.h"
+#include "TensorNames.h"
 #include "TensorPlanning.h"
+#include "WeightPacking.h"
 #include "tensorflow/lite/c/builtin_op_data.h"
 #include "tensorflow/lite/micro/kernels/all_ops_resolver.h"
 #include "tensorflow/lite/micro/memory_planner/greedy_memory_planner.h"
@@ -18,33 +40,222 @@
 #include "tensorflow/lite/schema/schema_generated.h"
 #include "tensorflow/lite/version.h"
 
+// Writes data as string literal initializer. Compilers parse string literals
+// much faster than lists of numbers. The literal is split into lines, which
+// are concatenated by the compiler.
+void WriteByteArrayCode(std::ostream &out, const void *data, size_t len) {
+  constexpr size_t kBytesPerLine = 32;
+  static const auto kHexLut = [] {
+    std::array<std::array<char, 4>, 256> lut;
+    const char *digits = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+      lut[i] = {'\\', 'x', digits[i >> 4], digits[i & 15]};
+    }
+    return lut;
+  }();
+
+  auto bytes = (const unsigned char *)data;
+  if (len <= kBytesPerLine) {
+    out << "{\"";
+    for (size_t i = 0; i < len; i++) {
+      out.write(kHexLut[bytes[i]].data(), 4);
+    }
+    out << "\"}";
+    return;
+  }
+  char line[kBytesPerLine * 4 + 4] = {'\n', ' ', ' ', '"'};
+  out << "{";
+  for (size_t start = 0; start < len; start += kBytesPerLine) {
+    size_t lineLen = std::min(kBytesPerLine, len - start);
+    char *p = line + 4;
+    for (size_t i = 0; i < lineLen; i++, p += 4) {
+      memcpy(p, kHexLut[bytes[start + i]].data(), 4);
+    }
+    *p++ = '"';
+    out.write(line, p - line);
+  }
+  out << "}";
+}
+
 std::string GetByteArrayCode(const void *data, size_t len) {
   std::stringstream out;
-  out << "{\"";
-  for (size_t i = 0; i < len; i++) {
-    out << "\\x" << std::setw(2) << std::setfill('0') << std::hex
-        << (int)((unsigned char *)data)[i];
-  }
-  out << "\"}";
+  WriteByteArrayCode(out, data, len);
   return out.str();
 }
 
-std::string FillCodeTemplate(const std::vector<char> &fb, size_t arenaSize,
-                             const std::string &setupCode,
-                             const std::string &evalCode, int numRegs,
-                             int numOps, int numQuants, int intArrayBufSize,
-                             int floatArrayBufSize, int inputTensorIndex,
-                             int outputTensorIndex,
-                             const std::vector<std::string> &fakeAllocPtrs) {
-  std::stringstream out;
+// Returns the initializer of an array. It holds emptyElement if elements is
+// empty, as C++ does not allow empty arrays.
+static std::string GetArrayCode(const std::vector<std::string> &elements,
+                                const char *emptyElement) {
+  std::string out = "{";
+  std::string emptyOrComma = "";
+  for (const auto &element : elements) {
+    out += emptyOrComma + element;
+    emptyOrComma = ", ";
+  }
+  return out + (elements.empty() ? emptyElement : "") + "}";
+}
+
+// Initializer of a g_tensors or g_node entry.
+struct TableRow {
+  std::string comment;
+  std::string init;
+};
+
+// Pieces of the target code that FillCodeTemplate puts together. They refer
+// to tensor_arena, g_ctx, g_tensors and g_node, which are local aliases of the
+// instance members in multi-instance mode.
+struct CodeParts {
+  // Declarations at global scope.
+  std::string declCode;
+  // Constant data.
+  std::string dataCode;
+  std::vector<TableRow> tensorRows;
+  std::vector<TableRow> nodeRows;
+  // Fills g_regOp.
+  std::string regCode;
+  std::string setupCode;
+  std::string evalCode;
+  std::string ioCode;
+  int numRegs = 0;
+  // Arena buffers returned by AllocatePersistentBuffer and GetScratchBuffer.
+  std::vector<OfflineOffset> fakeAllocs;
+  std::vector<OfflineOffset> scratchBuffers;
+};
+
+// Returns pointers to the arena buffers, or their offsets in multi-instance
+// mode.
+static std::vector<std::string> GetArenaBufferCode(
+    const std::vector<OfflineOffset> &buffers, bool multiInstance) {
+  std::vector<std::string> out;
+  for (const auto &buffer : buffers) {
+    out.push_back(multiInstance ? std::to_string(buffer.getOffset())
+                                : buffer.getPtrCode());
+  }
+  return out;
+}
+
+// Returns the assembler symbol of constant data in the given file.
+static std::string GetWeightsSymbol(const std::string &weightsBinFile) {
+  auto name = weightsBinFile.substr(weightsBinFile.find_last_of("/\\") + 1);
+  // Only the extension is dropped, e.g. model.v2.bin -> model_v2.
+  auto extension = name.rfind('.');
+  if (extension != std::string::npos && extension > 0) {
+    name.resize(extension);
+  }
+  for (auto &c : name) {
+    if (!isalnum((unsigned char)c)) c = '_';
+  }
+  return "tflm_model_data_" + name;
+}
+
+struct ProfileEntry {
+  std::string opName;
+  std::string tensorNames;
+};
+
+// Returns the declarations of the profiling hooks, the tables of profiled
+// operations and default hooks that measure host time. Without profiled
+// operations, the default hooks do nothing.
+static std::string GetOpProfileCode(const std::vector<ProfileEntry> &entries) {
+  std::vector<std::string> opNames;
+  std::vector<std::string> tensorNames;
+  for (const auto &entry : entries) {
+    opNames.push_back("\"" + entry.opName + "\"");
+    tensorNames.push_back("\"" + entry.tensorNames + "\"");
+  }
+  std::stringstream code;
+  code << R"CODE(
+// Called around every operation in Eval(). index is the position of the
+// operation in Eval(). Define the hooks to replace the default ones.
+void OpProfileBegin(int index, const char *op, const char *tensors);
+void OpProfileEnd(int index, const char *op, const char *tensors);
+// Prints the time spent in every operation (default hooks only).
+void DumpOpProfile();
+)CODE";
+  const char *noOpHooks = R"CODE(
+__attribute__((weak)) void OpProfileBegin(int index, const char *op,
+                                          const char *tensors) {}
+__attribute__((weak)) void OpProfileEnd(int index, const char *op,
+                                        const char *tensors) {}
+__attribute__((weak)) void DumpOpProfile() {}
+)CODE";
+  if (entries.empty()) {
+    code << noOpHooks;
+    return code.str();
+  }
+  code << R"CODE(
+namespace {
+)CODE";
+  code << "constexpr int kNumProfiledOps = " << entries.size() << ";\n";
+  code << "const char *const g_profileOps[] = "
+       << GetArrayCode(opNames, "nullptr") << ";\n";
+  code << "const char *const g_profileTensors[] = "
+       << GetArrayCode(tensorNames, "nullptr") << ";\n";
+  code << R"CODE(}  // namespace
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+
+// An instance runs on one thread at a time, so the start time is per thread.
+// The times of concurrent instances (--multi-instance) add up per operation.
+namespace {
+thread_local std::chrono::steady_clock::time_point g_profileStart;
+std::atomic<unsigned long long> g_profileNs[kNumProfiledOps];
+std::atomic<unsigned> g_profileCalls[kNumProfiledOps];
+}  // namespace
+
+__attribute__((weak)) void OpProfileBegin(int index, const char *op,
+                                          const char *tensors) {
+  g_profileStart = std::chrono::steady_clock::now();
+}
+__attribute__((weak)) void OpProfileEnd(int index, const char *op,
+                                        const char *tensors) {
+  g_profileNs[index] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - g_profileStart)
+                            .count();
+  g_profileCalls[index]++;
+}
+__attribute__((weak)) void DumpOpProfile() {
+  unsigned long long total = 0;
+  for (int i = 0; i < kNumProfiledOps; i++) {
+    total += g_profileNs[i];
+  }
+  printf("%5s %-24s %8s %12s %6s  %s\n", "index", "op", "calls", "avg ns",
+         "share", "tensors");
+  for (int i = 0; i < kNumProfiledOps; i++) {
+    unsigned calls = g_profileCalls[i];
+    unsigned long long ns = g_profileNs[i];
+    printf("%5d %-24s %8u %12llu %5.1f%%  %s\n", i, g_profileOps[i], calls,
+           calls ? ns / calls : 0, total ? 100.0 * ns / total : 0.0,
+           g_profileTensors[i]);
+  }
+}
+#else)CODE";
+  code << noOpHooks << "#endif\n";
+  return code.str();
+}
+
+// Constant data is emitted as array, or included from weightsBinFile if it is
+// not empty. sineTest adds TestEval() for the TFLM sine example.
+void WriteCodeTemplate(std::ostream &out, const std::vector<char> &constData,
+                       size_t arenaSize, const CodeParts &parts,
+                       bool multiInstance, const std::string &weightsBinFile,
+                       bool sineTest) {
   out << "// This file is generated. Do not edit.\n";
   {
     auto t = std::time(nullptr);
-    auto tm = *std::localtime(&t);
+    std::tm tm;
+    localtime_r(&t, &tm);
     out << "// Generated on: " << std::put_time(&tm, "%d.%m.%Y %H:%M:%S")
         << "\n";
   }
   out << R"CODE(
+#include <string.h>
+
 #include "tensorflow/lite/c/common.h"
 #include "tensorflow/lite/micro/kernels/micro_ops.h"
 
@@ -55,98 +266,210 @@ std::string FillCodeTemplate(const std::vector<char> &fb, size_t arenaSize,
 #define DBGPRINTF(format, ...)
 #endif
 
-namespace {
 )CODE";
-  // Flatbuffer. TODO: can drop everything but the actual buffers.
-  out << "const unsigned char g_model_data[] __attribute__((aligned(4))) = ";
-  out << GetByteArrayCode(fb.data(), fb.size());
-  out << ";\n";
-  out << "const int g_model_data_len = " << fb.size() << ";\n";
+  out << parts.declCode;
+  if (!weightsBinFile.empty()) {
+    // The symbol is only hidden, not local, so that LTO can resolve it.
+    auto symbol = GetWeightsSymbol(weightsBinFile);
+    out << "\n// Constant data is included by the assembler.\n";
+    out << "__asm__(\".section .rodata." << symbol << ", \\\"a\\\"\\n\"\n";
+    out << "        \".balign 16\\n\"\n";
+    out << "        \".globl " << symbol << "\\n\"\n";
+    out << "        \".hidden " << symbol << "\\n\"\n";
+    out << "        \"" << symbol << ":\\n\"\n";
+    out << "        \".incbin \\\"" << weightsBinFile << "\\\"\\n\"\n";
+    out << "        \".previous\\n\");\n";
+    out << "extern \"C\" const unsigned char " << symbol << "[];\n";
+  }
+  out << "\nnamespace {\n";
+  // Constant data referenced from the flatbuffer.
+  if (weightsBinFile.empty()) {
+    out << "const unsigned char g_model_data[] __attribute__((aligned(16))) = ";
+    WriteByteArrayCode(out, constData.data(), constData.size());
+    out << ";\n";
+  } else {
+    out << "constexpr const unsigned char *g_model_data = "
+        << GetWeightsSymbol(weightsBinFile) << ";\n";
+  }
+  out << "const int g_model_data_len = " << constData.size() << ";\n";
   out << "\n";
   // Tensor buffer size.
   out << "constexpr int kTensorArenaSize = " << arenaSize << ";\n";
-  out << "uint8_t tensor_arena[kTensorArenaSize] "
-         "__attribute__((aligned(16)));\n";
-  out << "\n";
-  out << "TfLiteRegistration *g_regOp[" << numRegs << "];\n";
-  out << "TfLiteNode g_node[" << numOps << "];\n";
-  if (numQuants) {
-    out << "TfLiteAffineQuantization g_quants[" << numQuants << "];\n";
-  }
-  if (floatArrayBufSize) {
-    out << "char g_intArrayBuf[" << intArrayBufSize << "];\n";
-    out << "char g_floatArrayBuf[" << floatArrayBufSize << "];\n";
+  if (!multiInstance) {
+    out << "uint8_t tensor_arena[kTensorArenaSize] "
+           "__attribute__((aligned(16)));\n";
   }
-  out << "TfLiteContext g_ctx{};\n";
   out << "\n";
-  out << "static void *g_fakeAllocPtrs[] = {";
-  std::string emptyOrComma = "";
-  for (const auto &fakeAllocPtr : fakeAllocPtrs) {
-    out << emptyOrComma << fakeAllocPtr;
-    emptyOrComma = ", ";
-  }
-  out << "};";
-  out << R"CODE(
+  out << GetStructLayoutCheckCode();
+  out << "\n";
+  out << parts.dataCode;
+  out << "\n";
+  out << "TfLiteRegistration *g_regOp[" << parts.numRegs << "];\n";
+
+  auto fakeAllocs = GetArenaBufferCode(parts.fakeAllocs, multiInstance);
+  auto scratchBuffers = GetArenaBufferCode(parts.scratchBuffers, multiInstance);
+  if (!multiInstance) {
+    out << "TfLiteContext g_ctx{};\n";
+    out << "TfLiteTensor g_tensors[" << parts.tensorRows.size() << "] = {\n";
+    for (const auto &row : parts.tensorRows) {
+      out << "  // " << row.comment << "\n  " << row.init << ",\n";
+    }
+    out << "};\n";
+    out << "TfLiteNode g_node[" << parts.nodeRows.size() << "] = {\n";
+    for (const auto &row : parts.nodeRows) {
+      out << "  // " << row.comment << "\n  " << row.init << ",\n";
+    }
+    out << "};\n";
+    out << "\n";
+    out << "static void *const g_fakeAllocPtrs[] = "
+        << GetArrayCode(fakeAllocs, "nullptr") << ";\n";
+    out << "static void *const g_scratchBuffers[] = "
+        << GetArrayCode(scratchBuffers, "nullptr") << ";";
+    out << R"CODE(
 static int g_fakeAllocCount = 0;
 static TfLiteStatus FakeAllocatePersistentBuffer(struct TfLiteContext* ctx,
                                                  size_t bytes, void** ptr) {
   *ptr = g_fakeAllocPtrs[g_fakeAllocCount++];
   return kTfLiteOk;
 }
+static int g_scratchRequestCount = 0;
+static TfLiteStatus FakeRequestScratchBufferInArena(struct TfLiteContext* ctx,
+                                                    size_t bytes,
+                                                    int* buffer_idx) {
+  *buffer_idx = g_scratchRequestCount++;
+  return kTfLiteOk;
+}
+static void* GetScratchBuffer(struct TfLiteContext* ctx, int buffer_idx) {
+  return g_scratchBuffers[buffer_idx];
+}
 } // namespace
 
 
 void Setup() {
   g_ctx.impl_ = nullptr;
-  g_ctx.ReportError = nullptr;
-  g_ctx.recommended_num_threads = 1;
-  g_ctx.AllocatePersistentBuffer = &FakeAllocatePersistentBuffer;
-
-  // TODO: CorrectTensorEndianness -> do that offline
-
 )CODE";
-  out << setupCode;
-  out << R"CODE(}
+    out << parts.regCode;
+  } else {
+    out << "} // namespace\n";
+    out << R"CODE(
+// Mutable state of one inference stream. All instances share the constant
+// data and operator registrations.
+struct ModelInstance {
+  uint8_t tensor_arena[kTensorArenaSize] __attribute__((aligned(16)));
+  TfLiteContext ctx;
+)CODE";
+    out << "  TfLiteTensor tensors[" << parts.tensorRows.size() << "];\n";
+    out << "  TfLiteNode nodes[" << parts.nodeRows.size() << "];\n";
+    out << R"CODE(  int fakeAllocCount;
+  int scratchRequestCount;
+};
 
-void *GetInputPtr()
-{
-  return g_ctx.tensors[)CODE" +
-             std::to_string(inputTensorIndex) + R"CODE(].data.data;
+namespace {
+)CODE";
+    out << "const size_t g_fakeAllocOffsets[] = "
+        << GetArrayCode(fakeAllocs, "0") << ";\n";
+    out << "const size_t g_scratchBufferOffsets[] = "
+        << GetArrayCode(scratchBuffers, "0") << ";";
+    out << R"CODE(
+static TfLiteStatus FakeAllocatePersistentBuffer(struct TfLiteContext* ctx,
+                                                 size_t bytes, void** ptr) {
+  auto inst = (ModelInstance*)ctx->impl_;
+  *ptr = inst->tensor_arena + g_fakeAllocOffsets[inst->fakeAllocCount++];
+  return kTfLiteOk;
 }
-const void *GetOutputPtr()
-{
-  return g_ctx.tensors[)CODE" +
-             std::to_string(outputTensorIndex) + R"CODE(].data.data;
+static TfLiteStatus FakeRequestScratchBufferInArena(struct TfLiteContext* ctx,
+                                                    size_t bytes,
+                                                    int* buffer_idx) {
+  *buffer_idx = ((ModelInstance*)ctx->impl_)->scratchRequestCount++;
+  return kTfLiteOk;
+}
+static void* GetScratchBuffer(struct TfLiteContext* ctx, int buffer_idx) {
+  return ((ModelInstance*)ctx->impl_)->tensor_arena +
+         g_scratchBufferOffsets[buffer_idx];
 }
+static void RegisterOps() {
+)CODE";
+    out << parts.regCode;
+    out << R"CODE(}
+} // namespace
+
+ModelInstance *CreateInstance() { return new ModelInstance(); }
+void DestroyInstance(ModelInstance *inst) { delete inst; }
+
+void Setup(ModelInstance *inst) {
+  // Registrations are shared, thread-safe static initialization.
+  static const bool registered = (RegisterOps(), true);
+  (void)registered;
+  uint8_t *const tensor_arena = inst->tensor_arena;
+  TfLiteContext &g_ctx = inst->ctx;
+  TfLiteTensor *const g_tensors = inst->tensors;
+  TfLiteNode *const g_node = inst->nodes;
+  (void)tensor_arena;
 
-void Eval()
-{
 )CODE";
-  out << evalCode;
-  out << R"CODE(}
-
-float SineTestEval(float in)
-{
-  *(float*)GetInputPtr() = in;
-  Eval();
-  return *(float*)GetOutputPtr();
-}
-void TestEval()
-{
-  Setup();
-  auto v1 = SineTestEval(0);
-  auto v2 = SineTestEval(3.14f / 2);
-  auto v3 = SineTestEval(3.14f);
-  auto v4 = SineTestEval((3.14f * 3) / 2);
-  auto v5 = SineTestEval(2 * 3.14f);
-  DBGPRINTF("0:     %+.02f\n", v1);
+    for (size_t i = 0; i < parts.tensorRows.size(); i++) {
+      out << "  // " << parts.tensorRows[i].comment << "\n";
+      out << "  g_tensors[" << i << "] = " << parts.tensorRows[i].init
+          << ";\n";
+    }
+    for (size_t i = 0; i < parts.nodeRows.size(); i++) {
+      out << "  // " << parts.nodeRows[i].comment << "\n";
+      out << "  g_node[" << i << "] = " << parts.nodeRows[i].init << ";\n";
+    }
+    out << "\n";
+    out << "  g_ctx.impl_ = inst;\n";
+  }
+  out << R"CODE(  g_ctx.ReportError = nullptr;
+  g_ctx.recommended_num_threads = 1;
+  g_ctx.AllocatePersistentBuffer = &FakeAllocatePersistentBuffer;
+  g_ctx.RequestScratchBufferInArena = &FakeRequestScratchBufferInArena;
+  g_ctx.GetScratchBuffer = &GetScratchBuffer;
+
+  // TODO: CorrectTensorEndianness -> do that offline
+
+)CODE";
+  out << parts.setupCode;
+  out << "}\n\n";
+  out << parts.ioCode;
+  std::string instParam = multiInstance ? "ModelInstance *inst" : "";
+  std::string instArg = multiInstance ? "inst" : "";
+  std::string instArgComma = multiInstance ? "inst, " : "";
+  out << "\nvoid Eval(" << instParam << ")\n{\n";
+  if (multiInstance) {
+    out << "  TfLiteContext &g_ctx = inst->ctx;\n";
+    out << "  TfLiteNode *const g_node = inst->nodes;\n";
+  }
+  out << parts.evalCode;
+  out << "}\n";
+  if (!sineTest) {
+    return;
+  }
+  out << "\nfloat SineTestEval(" << instParam << (multiInstance ? ", " : "")
+      << "float in)\n{\n";
+  out << "  *(float*)GetInputPtr(" << instArg << ") = in;\n";
+  out << "  Eval(" << instArg << ");\n";
+  out << "  return *(float*)GetOutputPtr(" << instArg << ");\n";
+  out << "}\n";
+  out << "void TestEval()\n{\n";
+  if (multiInstance) {
+    out << "  ModelInstance *inst = CreateInstance();\n";
+  }
+  out << "  Setup(" << instArg << ");\n";
+  out << "  auto v1 = SineTestEval(" << instArgComma << "0);\n";
+  out << "  auto v2 = SineTestEval(" << instArgComma << "3.14f / 2);\n";
+  out << "  auto v3 = SineTestEval(" << instArgComma << "3.14f);\n";
+  out << "  auto v4 = SineTestEval(" << instArgComma << "(3.14f * 3) / 2);\n";
+  out << "  auto v5 = SineTestEval(" << instArgComma << "2 * 3.14f);\n";
+  if (multiInstance) {
+    out << "  DestroyInstance(inst);\n";
+  }
+  out << R"CODE(  DBGPRINTF("0:     %+.02f\n", v1);
   DBGPRINTF("pi/2:  %+.02f\n", v2);
   DBGPRINTF("pi:    %+.02f\n", v3);
   DBGPRINTF("3pi/2: %+.02f\n", v4);
   DBGPRINTF("2pi:   %+.02f\n", v5);
 }
 )CODE";
-  return out.str();
 }
 
 // Tracks the last allocation size.
@@ -174,24 +497,6 @@ static size_t GetBuiltinDataSize(tflite::BuiltinOperator opType,
   return allocator.GetLastAllocSize();
 }
 
-static std::string GetDeepCopyCode(void *data, size_t data_len,
-                                   const std::string &assignVarName,
-                                   const std::string &indent) {
-  static std::regex reMakeIdentifier("([\\.\\->])");
-  std::string tempVarName =
-      "buf_" +
-      std::regex_replace(assignVarName, reMakeIdentifier, std::string("_"));
-
-  std::stringstream ss;
-  if (data) {
-    ss << indent << "static char " << tempVarName
-       << "[] = " << GetByteArrayCode(data, data_len) << ";\n";
-  }
-  ss << indent << assignVarName << " = " << (data ? tempVarName : "nullptr")
-     << ";\n";
-  return ss.str();
-}
-
 // Aligns a value v to the next value aligned by align bits.
 template <typename T>
 T Align(T v, T align) {
@@ -202,16 +507,56 @@ T *Align(T *v, U align) {
   return (T *)Align((uintptr_t)v, (uintptr_t)align);
 }
 
-static size_t DryRunModelForAllocSize(const tflite::Model *model) {
-  std::vector<uint8_t> tmp_arena(100 * 1024);
+// Drops the errors of dry runs, which are expected to fail.
+class SilentErrorReporter : public tflite::ErrorReporter {
+ public:
+  int Report(const char *format, va_list args) override { return 0; }
+  using tflite::ErrorReporter::Report;
+};
+
+// Returns whether TFLM allocates the model's tensors, kernel data and scratch
+// buffers in an aligned arena of the given size, and the bytes it used.
+static bool CanAllocateModel(const tflite::Model *model, size_t arenaSize,
+                             size_t *usedBytes) {
+  std::vector<uint8_t> arena(arenaSize + 16);
   tflite::ops::micro::AllOpsResolver resolver;
-  tflite::MicroErrorReporter error_reporter;
-  tflite::MicroInterpreter interpreter(model, resolver, tmp_arena.data(),
-                                       tmp_arena.size(), &error_reporter);
-  interpreter.AllocateTensors();
+  SilentErrorReporter error_reporter;
+  tflite::MicroInterpreter interpreter(model, resolver, Align(arena.data(), 16),
+                                       arenaSize, &error_reporter);
+  bool fits = interpreter.AllocateTensors() == kTfLiteOk;
+  *usedBytes = interpreter.arena_used_bytes();
+  return fits;
+}
 
-  size_t requiredSize = interpreter.arena_used_bytes();
-  return Align(requiredSize, (size_t)16);
+// Finds the smallest arena that TFLM can run the model in. The arena grows
+// geometrically until allocation succeeds. The bytes used then are a lower
+// bound, the planner also needs temporary space, so the size is bisected
+// between the two in steps of the buffer alignment. Returns 0 if the model does
+// not fit into kMaxArenaSize.
+static size_t DryRunModelForAllocSize(const tflite::Model *model) {
+  const size_t kAlignment = 16;
+  const size_t kMaxArenaSize = (size_t)1 << 30;
+  size_t fittingSize = 16 * 1024;
+  size_t usedBytes;
+  while (!CanAllocateModel(model, fittingSize, &usedBytes)) {
+    fittingSize *= 2;
+    if (fittingSize > kMaxArenaSize) return 0;
+  }
+  size_t minSize = Align(usedBytes, kAlignment);
+  if (minSize >= fittingSize || CanAllocateModel(model, minSize, &usedBytes)) {
+    return std::min(minSize, fittingSize);
+  }
+  size_t failedSize = minSize;
+  while (fittingSize - failedSize > kAlignment) {
+    size_t size =
+        failedSize + (fittingSize - failedSize) / (2 * kAlignment) * kAlignment;
+    if (CanAllocateModel(model, size, &usedBytes)) {
+      fittingSize = size;
+    } else {
+      failedSize = size;
+    }
+  }
+  return fittingSize;
 }
 
 struct Allocation {
@@ -219,26 +564,45 @@ struct Allocation {
   size_t len;
   int nodeIndex;
 };
-static std::vector<Allocation> g_loggedAllocations;
-static tflite::MicroAllocator *g_allocator;
-static int g_currentNodeIndex = -1;
+struct ScratchRequest {
+  size_t len;
+  int nodeIndex;
+};
+// Allocations of one model, logged while its kernels run init and prepare.
+struct AllocationLog {
+  tflite::MicroAllocator *allocator;
+  int currentNodeIndex = -1;
+  std::vector<Allocation> allocations;
+  std::vector<ScratchRequest> scratchRequests;
+};
+// Context callbacks have no user pointer. Each thread logs the model it
+// records.
+static thread_local AllocationLog *g_allocationLog = nullptr;
 static TfLiteStatus LoggingAllocatePersistentBuffer(struct TfLiteContext *ctx,
                                                     size_t bytes, void **ptr) {
-  auto retVal = g_allocator->AllocatePersistentBuffer(bytes, ptr);
+  auto log = g_allocationLog;
+  auto retVal = log->allocator->AllocatePersistentBuffer(bytes, ptr);
   assert(retVal == kTfLiteOk && "Alloc failure");
-  g_loggedAllocations.push_back({*ptr, bytes, g_currentNodeIndex});
+  log->allocations.push_back({*ptr, bytes, log->currentNodeIndex});
   return retVal;
 }
 static TfLiteStatus LoggingRequestScratchBufferInArena(TfLiteContext *ctx,
                                                        size_t bytes,
                                                        int *buffer_idx) {
-  assert(false && "Not handling scratch buffers currently");
-  return g_allocator->RequestScratchBufferInArena(g_currentNodeIndex, bytes,
-                                                  buffer_idx);
+  auto log = g_allocationLog;
+  auto retVal = log->allocator->RequestScratchBufferInArena(
+      log->currentNodeIndex, bytes, buffer_idx);
+  assert(retVal == kTfLiteOk && "Scratch request failure");
+  // The target hands out the same indices in the same order.
+  assert(*buffer_idx == (int)log->scratchRequests.size() &&
+         "Unexpected scratch buffer index");
+  log->scratchRequests.push_back({bytes, log->currentNodeIndex});
+  return retVal;
 }
 static std::vector<Allocation> RecordAllocations(
     const tflite::Model *model, const tflite::SubGraph *subgraph,
-    uint8_t *tensor_arena, size_t tensorArenaSize) {
+    uint8_t *tensor_arena, size_t tensorArenaSize,
+    std::vector<ScratchRequest> *scratchRequests) {
   tflite::MicroErrorReporter error_reporter;
   tflite::ops::micro::AllOpsResolver resolver;
   tflite::MicroInterpreter interpreter(model, resolver, tensor_arena,
@@ -250,7 +614,9 @@ static std::vector<Allocation> RecordAllocations(
   tflite::NodeAndRegistration *nodeAndRegs;
   allocator->AllocateNodeAndRegistrations(resolver, &nodeAndRegs);
 
-  g_allocator = allocator;
+  AllocationLog log;
+  log.allocator = allocator;
+  g_allocationLog = &log;
   ctx->AllocatePersistentBuffer = &LoggingAllocatePersistentBuffer;
   ctx->RequestScratchBufferInArena = nullptr;
   ctx->GetScratchBuffer = nullptr;
@@ -259,7 +625,7 @@ static std::vector<Allocation> RecordAllocations(
     auto node = &nodeAndRegs[i].node;
     auto reg = nodeAndRegs[i].registration;
     if (reg->init) {
-      g_currentNodeIndex = i;
+      log.currentNodeIndex = i;
       node->user_data = reg->init(ctx, (const char *)node->builtin_data, 0);
     }
   }
@@ -270,54 +636,234 @@ static std::vector<Allocation> RecordAllocations(
     auto node = &nodeAndRegs[i].node;
     auto reg = nodeAndRegs[i].registration;
     if (reg->prepare) {
-      g_currentNodeIndex = i;
+      log.currentNodeIndex = i;
       reg->prepare(ctx, node);
     }
   }
 
-  return g_loggedAllocations;
+  g_allocationLog = nullptr;
+  *scratchRequests = std::move(log.scratchRequests);
+  return std::move(log.allocations);
 }
 
-static std::vector<std::string> GetTensorNames(
-    const tflite::MicroInterpreter &interpreter) {
-  std::vector<std::string> tensorNames;
-  for (int i = 0; i < interpreter.tensors_size(); i++) {
-    tensorNames.push_back("T" + std::to_string(i) + "_");
+// Contents of a persistent buffer after init and prepare ran offline.
+struct PersistentSnapshot {
+  const Allocation *alloc;
+  // Offsets of pointers inside of the buffer.
+  std::vector<size_t> ptrOffsets;
+};
+// Reads a little-endian pointer of the target's width.
+static const void *ReadTargetPointer(const void *p, size_t ptrSize) {
+  uint64_t value = 0;
+  memcpy(&value, p, ptrSize);
+  return (const void *)(uintptr_t)value;
+}
+// Finds the pointers in the persistent buffers, which are relocated on the
+// target. Values are not trusted to be pointers because they fall into a
+// buffer: init and prepare run a second time with the arena and the model at
+// other addresses, and only words that move by exactly the distance of their
+// buffer are pointers. Fails if any other word changes, or if kernel data
+// points to memory that the target does not have. The kernel data has the
+// host's struct layout, so the generator must be built for the target's ABI.
+// Only the pointer width can be checked here.
+static bool SnapshotPersistentBuffers(
+    const std::vector<Allocation> &allocations,
+    const tflite::MicroInterpreter &interpreter,
+    const std::vector<int> &schedule, const std::vector<char> &modelData,
+    const uint8_t *tensorArena, size_t tensorArenaSize,
+    const OfflineOffsetContext &offsetContext, size_t ptrSize,
+    std::vector<PersistentSnapshot> *snapshots) {
+  if (ptrSize != sizeof(void *)) {
+    printf("Cannot snapshot for %lu-byte pointers, the generator uses %lu-byte "
+           "pointers (build it for the target's ABI)\n",
+           ptrSize, sizeof(void *));
+    return false;
+  }
+  for (int i : schedule) {
+    void *userData = interpreter.node_and_registration(i).node.user_data;
+    if (userData && !offsetContext.isOnTarget(userData)) {
+      printf("Cannot snapshot user data of operation %i\n", i);
+      return false;
+    }
   }
 
-  auto nOps = interpreter.operators_size();
-  for (int i = 0; i < nOps; i++) {
-    auto nodeAndReg = interpreter.node_and_registration(i);
-    auto node = &nodeAndReg.node;
-
-    if (node->inputs) {
-      for (int k = 0; k < node->inputs->size; k++) {
-        tensorNames[node->inputs->data[k]] += "L" + std::to_string(i) + "IN";
-      }
+  // Both copies live while the allocations are compared, so their addresses
+  // differ from the original buffers.
+  std::vector<char> movedModelData(modelData);
+  std::vector<uint8_t> movedArenaBuf(tensorArenaSize + 16);
+  uint8_t *movedArena = Align(movedArenaBuf.data(), 16);
+  auto movedModel = tflite::GetModel(movedModelData.data());
+  std::vector<ScratchRequest> movedScratchRequests;
+  auto movedAllocations =
+      RecordAllocations(movedModel, (*movedModel->subgraphs())[0], movedArena,
+                        tensorArenaSize, &movedScratchRequests);
+  std::map<uintptr_t, const Allocation *> movedByOffset;
+  for (const auto &alloc : movedAllocations) {
+    movedByOffset[(uintptr_t)alloc.p - (uintptr_t)movedArena] = &alloc;
+  }
+  uintptr_t arenaDelta = (uintptr_t)movedArena - (uintptr_t)tensorArena;
+  uintptr_t fbDelta =
+      (uintptr_t)movedModelData.data() - (uintptr_t)modelData.data();
+
+  for (const auto &alloc : allocations) {
+    auto moved =
+        movedByOffset.find((uintptr_t)alloc.p - (uintptr_t)tensorArena);
+    if (moved == movedByOffset.end() || moved->second->len != alloc.len) {
+      printf("Persistent buffers of operation %i depend on the arena address\n",
+             alloc.nodeIndex);
+      return false;
     }
-    if (node->outputs) {
-      for (int k = 0; k < node->outputs->size; k++) {
-        tensorNames[node->outputs->data[k]] += "L" + std::to_string(i) + "OUT";
+    const char *data = (const char *)alloc.p;
+    const char *movedData = (const char *)moved->second->p;
+    PersistentSnapshot snapshot{&alloc, {}};
+    size_t k = 0;
+    for (; k + ptrSize <= alloc.len; k += ptrSize) {
+      auto p = ReadTargetPointer(data + k, ptrSize);
+      auto movedP = ReadTargetPointer(movedData + k, ptrSize);
+      if (p == movedP) continue;
+      uintptr_t delta = (uintptr_t)movedP - (uintptr_t)p;
+      bool isPtr = false;
+      if (offsetContext.isInOfflineBuffers(p)) {
+        auto type = OfflineOffset(offsetContext, p).getType();
+        isPtr = (type == OfflineOffset::Type::Arena && delta == arenaDelta) ||
+                (type == OfflineOffset::Type::FB && delta == fbDelta);
       }
-    }
-    if (node->intermediates) {
-      for (int k = 0; k < node->intermediates->size; k++) {
-        tensorNames[node->intermediates->data[k]] +=
-            "L" + std::to_string(i) + "INT";
+      if (!isPtr || !offsetContext.isOnTarget(p)) {
+        printf("Cannot snapshot persistent buffer of operation %i\n",
+               alloc.nodeIndex);
+        return false;
       }
+      snapshot.ptrOffsets.push_back(k);
     }
-    if (node->temporaries) {
-      for (int k = 0; k < node->temporaries->size; k++) {
-        tensorNames[node->temporaries->data[k]] +=
-            "L" + std::to_string(i) + "TMP";
-      }
+    if (memcmp(data + k, movedData + k, alloc.len - k) != 0) {
+      printf("Cannot snapshot persistent buffer of operation %i\n",
+             alloc.nodeIndex);
+      return false;
     }
+    snapshots->push_back(snapshot);
   }
-  return tensorNames;
+  return true;
+}
+
+// Evaluates the operations whose inputs are all constant once, in model order.
+// Their outputs are constant as well, so chains of them are folded. Returns
+// which operations were folded and the data of their output tensors.
+static std::vector<bool> FoldConstantOperations(
+    tflite::MicroInterpreter *interpreter,
+    std::map<int, std::vector<char>> *foldedTensors) {
+  std::vector<bool> isConst(interpreter->tensors_size());
+  for (size_t i = 0; i < interpreter->tensors_size(); i++) {
+    isConst[i] = interpreter->tensor(i)->allocation_type == kTfLiteMmapRo;
+  }
+  std::vector<bool> folded(interpreter->operators_size());
+  for (size_t i = 0; i < interpreter->operators_size(); i++) {
+    auto nodeAndReg = interpreter->node_and_registration(i);
+    auto node = &nodeAndReg.node;
+    auto reg = nodeAndReg.registration;
+    // Custom operations might not be pure functions of their inputs.
+    bool foldable = reg->builtin_code != tflite::BuiltinOperator_CUSTOM &&
+                    node->inputs->size > 0 && node->outputs->size > 0 &&
+                    (!node->intermediates || node->intermediates->size == 0) &&
+                    (!node->temporaries || node->temporaries->size == 0);
+    for (int k = 0; k < node->inputs->size && foldable; k++) {
+      int t = node->inputs->data[k];
+      foldable = t < 0 || (isConst[t] && !interpreter->tensor(t)->is_variable);
+    }
+    if (!foldable) continue;
+
+    // The outputs are written to the offline interpreter's arena. They are
+    // copied right away, later operations may reuse the memory.
+    if (reg->invoke(GetContext(interpreter), node) != kTfLiteOk) {
+      printf("operation %lu: constant folding failed\n", i);
+      continue;
+    }
+    for (int k = 0; k < node->outputs->size; k++) {
+      int t = node->outputs->data[k];
+      if (t < 0) continue;
+      auto tensor = interpreter->tensor(t);
+      (*foldedTensors)[t].assign(tensor->data.raw,
+                                 tensor->data.raw + tensor->bytes);
+      isConst[t] = true;
+    }
+    folded[i] = true;
+  }
+  return folded;
+}
+
+struct Options {
+  enum class Planner { Greedy, Optimal };
+  Planner planner = Planner::Greedy;
+  // Time budget of the optimal planner's search.
+  int plannerTimeLimitMs = 10000;
+  // Emit the kernel data prepared offline instead of running init and
+  // prepare on the target.
+  bool snapshotPrepare = false;
+  // Pointer width of the target, snapshots are only emitted if the generator
+  // uses the same width.
+  size_t targetPtrSize = 4;
+  // Call known kernels' Eval functions directly instead of through their
+  // registration.
+  bool directCalls = false;
+  // Put the mutable state into instances that run independently.
+  bool multiInstance = false;
+  // Write the constant data to this file instead of into the code.
+  std::string weightsBinFile;
+  // Pack the weights of supported layers for a generated kernel.
+  bool packWeights = false;
+  // Evaluate operations with only constant inputs offline.
+  bool foldConstants = false;
+  // Merge activations into their producers and elementwise chains into
+  // loops.
+  bool fuseOps = false;
+  // Wrap every operation in Eval() in profiling hooks.
+  bool profile = false;
+  // Run the TFLM sine example's test values and emit TestEval().
+  bool sineTest = false;
+  // Let elementwise operations write their output over an input they are
+  // the last consumer of.
+  bool inPlace = false;
+  // Drop operations that only change the shape of their input.
+  bool removeViews = false;
+  // Run the operators in a valid order with a lower peak of live tensors.
+  bool reorderOps = false;
+  // Graphs up to this size are reordered by an exact search.
+  int maxExactReorderOps = 16;
+  // Run the leading convolutions and pools band by band, in up to maxTiles
+  // bands.
+  bool tileLeadingBlock = false;
+  int maxTiles = 8;
+  // Generate many models on batchJobs threads, 0 for one per core.
+  bool batch = false;
+  int batchJobs = 0;
+  // Directory of cached arena sizes, operator orders and memory plans.
+  std::string planCacheDir;
+  // Machine-readable memory maps with the live bytes per operation.
+  std::string memReportJsonFile;
+  std::string memReportCsvFile;
+};
+
+// Identifies the generator binary. A rebuild, e.g. against another TFLM, can
+// change arena sizes and kernel data, so cached plans are not reused by it.
+static const char kBuildId[] = __DATE__ " " __TIME__;
+
+// Returns the options that change the generated code, as part of the plan
+// cache key. Output file names are left out.
+static std::string GetOptionsKey(const Options &options) {
+  std::stringstream key;
+  key << kBuildId << " " << (int)options.planner << " "
+      << options.plannerTimeLimitMs << " " << options.snapshotPrepare << " "
+      << options.targetPtrSize << " " << options.directCalls << " "
+      << options.multiInstance << " " << !options.weightsBinFile.empty() << " "
+      << options.packWeights << " " << options.foldConstants << " "
+      << options.fuseOps << " " << options.profile << " " << options.sineTest
+      << " " << options.inPlace << " " << options.removeViews << " "
+      << options.reorderOps << " " << options.maxExactReorderOps << " "
+      << options.tileLeadingBlock << " " << options.maxTiles;
+  return key.str();
 }
 
 static bool Run(const std::string &modelFileName,
-                const std::string &outFileName) {
+                const std::string &outFileName, const Options &options) {
   MemMap memMap;
 
   tflite::MicroErrorReporter micro_error_reporter;
@@ -325,6 +871,10 @@ static bool Run(const std::string &modelFileName,
 
   // Load model flatbuffer.
   std::ifstream model_file(modelFileName, std::ios::binary | std::ios::ate);
+  if (!model_file) {
+    printf("failed to open model file %s\n", modelFileName.c_str());
+    return false;
+  }
   auto sz = model_file.tellg();
   model_file.seekg(0, std::ios::beg);
   std::vector<char> model_data(sz);
@@ -342,38 +892,99 @@ static bool Run(const std::string &modelFileName,
     return false;
   }
 
+  // TFLM only executes the first subgraph and has no control flow operations
+  // that could call into others.
   auto subgraphs = model->subgraphs();
-  if (subgraphs->size() != 1) {
-    printf("Only 1 subgraph supported\n");
+  if (subgraphs->size() == 0) {
+    printf("Model has no subgraph\n");
     return false;
+  } else if (subgraphs->size() > 1) {
+    printf("Ignoring %u subgraphs that TFLM does not execute\n",
+           subgraphs->size() - 1);
   }
   auto subgraph = (*subgraphs)[0];
   auto tensors = subgraph->tensors();
-  auto operators = subgraph->operators();
-  assert(subgraph->inputs()->size() == 1 && "Unexpected number of inputs");
-  assert(subgraph->outputs()->size() == 1 && "Unexpected number of outputs");
-  auto inputTensorIndex = subgraph->inputs()->Get(0);
-  auto outputTensorIndex = subgraph->outputs()->Get(0);
-
-  // Run the model once to get the arena size. This is done first because TFLM
-  // will also utilize buffers that start at the end of the buffer, which we
-  // want to directly translate.
-  auto tensorArenaSize = DryRunModelForAllocSize(model);
+  if (subgraph->inputs()->size() == 0 || subgraph->outputs()->size() == 0) {
+    printf("Model needs at least one input and output\n");
+    return false;
+  }
+
+  // Results of an earlier run on the same model bytes and options. The key is
+  // taken before the model is reordered.
+  CachedPlan cachedPlan;
+  CachedPlan newPlan;
+  std::string planCacheFile;
+  if (!options.planCacheDir.empty()) {
+    planCacheFile = GetPlanCacheFile(options.planCacheDir, model_data,
+                                     GetOptionsKey(options));
+    if (LoadCachedPlan(planCacheFile, &cachedPlan)) {
+      printf("plan cache: using %s\n", planCacheFile.c_str());
+    }
+  }
+
+  // Reorder the operators in the flatbuffer, everything else follows its
+  // order.
+  if (options.reorderOps) {
+    std::vector<int> original(subgraph->operators()->size());
+    for (size_t i = 0; i < original.size(); i++) {
+      original[i] = i;
+    }
+    // A cached order is only used if it is valid for this model.
+    auto order = IsTopologicalOrder(model, subgraph, cachedPlan.operatorOrder,
+                                    &error_reporter)
+                     ? cachedPlan.operatorOrder
+                     : GetMemoryOrder(model, subgraph,
+                                      options.maxExactReorderOps,
+                                      &error_reporter);
+    printf("operator order:");
+    for (int i : order) {
+      printf(" %i", i);
+    }
+    printf("\npeak live tensor bytes: %lu -> %lu\n",
+           GetPeakLiveBytes(model, subgraph, original, &error_reporter),
+           GetPeakLiveBytes(model, subgraph, order, &error_reporter));
+    if (!ReorderOperators(subgraph, order)) {
+      printf("Unexpected flatbuffer layout, keeping the operator order\n");
+      order = original;
+    }
+    newPlan.operatorOrder = order;
+  }
+
+  // Find the arena size with dry runs. This is done first because TFLM will
+  // also utilize buffers that start at the end of the buffer, which we want to
+  // directly translate.
+  // A cached size that no longer fits, e.g. after kernel changes, means the
+  // whole entry is stale: it is dropped and the model is planned again.
+  size_t usedBytes;
+  if (cachedPlan.tfliteArenaSize &&
+      !CanAllocateModel(model, cachedPlan.tfliteArenaSize, &usedBytes)) {
+    printf("plan cache: arena size %lu fails, discarding %s\n",
+           cachedPlan.tfliteArenaSize, planCacheFile.c_str());
+    std::remove(planCacheFile.c_str());
+    cachedPlan = CachedPlan();
+  }
+  auto tensorArenaSize = cachedPlan.tfliteArenaSize
+                             ? cachedPlan.tfliteArenaSize
+                             : DryRunModelForAllocSize(model);
+  newPlan.tfliteArenaSize = tensorArenaSize;
+  if (!tensorArenaSize) {
+    printf("AllocateTensors() fails for all arenas up to 1 GiB\n");
+    return false;
+  }
+  printf("TFLM arena size: %lu\n", tensorArenaSize);
   std::vector<uint8_t> tensorArena(tensorArenaSize + 16);
   uint8_t *tensor_arena = Align(tensorArena.data(), 16);
 
-  OfflineOffset::Init(tensor_arena, tensorArenaSize, model_data);
+  // Translates pointers of this run's buffers to the target.
+  OfflineOffsetContext offsetContext(tensor_arena, tensorArenaSize,
+                                     model_data);
+  auto GetPtrCode = [&](const void *p) {
+    return OfflineOffset(offsetContext, p).getPtrCode();
+  };
 
-  std::vector<std::string> fakeAllocPtrs;
-  for (const auto &alloc :
-       RecordAllocations(model, subgraph, tensor_arena, tensorArenaSize)) {
-    OfflineOffset offset(alloc.p);
-    fakeAllocPtrs.push_back(offset.getPtrCode());
-    assert(offset.getType() == OfflineOffset::Type::Arena &&
-           "Unexpected ptr loc");
-    memMap.record(offset, alloc.len,
-                  "PersistentBuffer_L" + std::to_string(alloc.nodeIndex));
-  }
+  std::vector<ScratchRequest> scratchRequests;
+  auto allocations = RecordAllocations(model, subgraph, tensor_arena,
+                                       tensorArenaSize, &scratchRequests);
 
   // Build an interpreter to run the model with.
   tflite::ops::micro::AllOpsResolver resolver;
@@ -392,103 +1003,486 @@ static bool Run(const std::string &modelFileName,
 
   auto tensorNames = GetTensorNames(interpreter);
 
-  // Run memory planning. Planner may be replaced with a custom one.
-  std::vector<uint8_t> plannerBuf(1024);
-  tflite::GreedyMemoryPlanner planner(plannerBuf.data(), plannerBuf.size());
+  // Operations that run on the target, in order. Folded operations are
+  // dropped, their outputs become constant data and need no arena.
+  std::map<int, std::vector<char>> foldedTensors;
+  std::vector<bool> folded(interpreter.operators_size());
+  if (options.foldConstants) {
+    folded = FoldConstantOperations(&interpreter, &foldedTensors);
+  }
+  std::vector<int> schedule;
+  for (size_t i = 0; i < interpreter.operators_size(); i++) {
+    if (folded[i]) {
+      printf("operation %lu: constant folded\n", i);
+    } else {
+      schedule.push_back(i);
+    }
+  }
+  for (const auto &tensor : foldedTensors) {
+    lifetimes[tensor.first].needsAlloc = false;
+  }
+
+  // Fused operations are dropped as well. The kernel data prepared offline
+  // does not know about changed activations, so they are only merged when
+  // prepare runs on the target.
+  FusionPlan fusion;
+  fusion.fusedOps.assign(interpreter.operators_size(), false);
+  if (options.fuseOps) {
+    fusion = PlanFusion(&interpreter, subgraph, schedule,
+                        !options.snapshotPrepare);
+    fusion.updateLifetimes(&lifetimes);
+    for (int i : schedule) {
+      if (fusion.fusedOps[i]) printf("operation %i: fused\n", i);
+    }
+    schedule.erase(std::remove_if(schedule.begin(), schedule.end(),
+                                  [&](int i) { return fusion.fusedOps[i]; }),
+                   schedule.end());
+  }
+  // Views of their input need not run, their output shares the input's
+  // buffer.
+  std::map<int, int> viewInputs;
+  if (options.removeViews) {
+    auto isView =
+        FindViewOperations(&interpreter, schedule, lifetimes, &viewInputs);
+    for (int i : schedule) {
+      if (isView[i]) printf("operation %i: view of its input\n", i);
+    }
+    schedule.erase(std::remove_if(schedule.begin(), schedule.end(),
+                                  [&](int i) { return isView[i]; }),
+                   schedule.end());
+  }
+  std::vector<bool> isScheduled(interpreter.operators_size());
+  for (int i : schedule) {
+    isScheduled[i] = true;
+  }
+  auto GetNode = [&](int i) {
+    auto node = interpreter.node_and_registration(i).node;
+    fusion.applyTo(i, &node);
+    return node;
+  };
+  allocations.erase(std::remove_if(allocations.begin(), allocations.end(),
+                                   [&](const Allocation &alloc) {
+                                     return alloc.nodeIndex >= 0 &&
+                                            !isScheduled[alloc.nodeIndex];
+                                   }),
+                    allocations.end());
+
+  // Run the leading block of convolutions and pools band by band. The
+  // kernels prepare the bands on the target, like for fused activations.
+  TilingPlan tiling;
+  if (options.tileLeadingBlock && options.snapshotPrepare) {
+    printf("Tiling needs prepare on the target, skipped\n");
+  } else if (options.tileLeadingBlock) {
+    tiling = PlanTiling(&interpreter, subgraph, schedule, fusion, lifetimes,
+                        viewInputs, options.maxTiles);
+    tiling.updateLifetimes(&lifetimes);
+  }
+
+  // Find the tensors that are used on the target.
+  std::vector<bool> tensorUsed(interpreter.tensors_size());
+  for (size_t i = 0; i < subgraph->inputs()->size(); i++) {
+    tensorUsed[subgraph->inputs()->Get(i)] = true;
+  }
+  for (size_t i = 0; i < subgraph->outputs()->size(); i++) {
+    tensorUsed[subgraph->outputs()->Get(i)] = true;
+  }
+  for (int i : schedule) {
+    auto node = GetNode(i);
+    for (auto tensorArray : {node.inputs, node.outputs, node.intermediates,
+                             node.temporaries}) {
+      if (!tensorArray) continue;
+      for (int k = 0; k < tensorArray->size; k++) {
+        if (tensorArray->data[k] >= 0) {
+          tensorUsed[tensorArray->data[k]] = true;
+        }
+      }
+    }
+  }
+  for (const auto &chain : fusion.chains) {
+    tensorUsed[chain.second.input] = true;
+    tensorUsed[chain.second.output] = true;
+    for (const auto &step : chain.second.steps) {
+      if (step.otherInput >= 0) tensorUsed[step.otherInput] = true;
+    }
+  }
+
+  // Pack the weights of supported layers offline. The original weights are
+  // only kept if other operations use them.
+  std::map<int, PackedLayer> packedLayers;
+  std::vector<bool> tensorDataUsed = tensorUsed;
+  for (size_t k = 0; k < schedule.size() && options.packWeights; k++) {
+    int i = schedule[k];
+    if (tiling.getTiledIndex(i) >= 0) continue;
+    auto node = GetNode(i);
+    auto code = tflite::EnumValuesBuiltinOperator()
+        [interpreter.node_and_registration(i).registration->builtin_code];
+    PackedLayer packed;
+    if (PackLayer(GetContext(&interpreter), code, &node, &packed)) {
+      printf("operation %i: packed weights\n", i);
+      packedLayers[i] = std::move(packed);
+      for (int t : GetPackedTensors(&node)) {
+        tensorDataUsed[t] = false;
+      }
+    }
+  }
+  for (int i : schedule) {
+    if (packedLayers.count(i)) continue;
+    auto node = GetNode(i);
+    for (auto tensorArray : {node.inputs, node.outputs}) {
+      for (int k = 0; k < tensorArray->size; k++) {
+        if (tensorArray->data[k] >= 0) {
+          tensorDataUsed[tensorArray->data[k]] = true;
+        }
+      }
+    }
+  }
+  for (int t : tiling.removedTensors) {
+    tensorUsed[t] = tensorDataUsed[t] = false;
+  }
+
+  // Only keep the parts of the flatbuffer that the target code points to.
+  ConstData constData(model_data);
+  auto AddConstBlock = [&](const void *p, size_t len) {
+    OfflineOffset offset(offsetContext, p);
+    if (offset.getType() == OfflineOffset::Type::FB) {
+      constData.addBlock(offset.getOffset(), len);
+    }
+  };
+  std::map<int, uintptr_t> foldedTensorOffsets;
+  for (int i = 0; i < interpreter.tensors_size(); i++) {
+    if (!tensorUsed[i]) continue;
+    if (tensorDataUsed[i] && foldedTensors.count(i)) {
+      const auto &data = foldedTensors[i];
+      foldedTensorOffsets[i] = constData.addData(data.data(), data.size());
+    } else if (tensorDataUsed[i]) {
+      AddConstBlock(interpreter.tensor(i)->data.data,
+                    interpreter.tensor(i)->bytes);
+    }
+    if (auto shape = tensors->Get(i)->shape()) {
+      AddConstBlock(shape, TfLiteIntArrayGetSizeInBytes(shape->size()));
+    }
+  }
+  // The packed data is constant data like folded tensors, so it is also
+  // deduplicated and can be placed in the weights binary.
+  struct PackedLayerOffsets {
+    uintptr_t weights, bias, outputMultipliers, outputShifts;
+  };
+  std::map<int, PackedLayerOffsets> packedLayerOffsets;
+  for (const auto &packed : packedLayers) {
+    const auto &layer = packed.second;
+    auto AddInts = [&](const std::vector<int32_t> &values) {
+      return constData.addData(values.data(), values.size() * sizeof(int32_t));
+    };
+    packedLayerOffsets[packed.first] = {
+        constData.addData(layer.weights.data(), layer.weights.size()),
+        AddInts(layer.bias), AddInts(layer.outputMultipliers),
+        AddInts(layer.outputShifts)};
+  }
+  for (int i : schedule) {
+    auto nodeAndReg = interpreter.node_and_registration(i);
+    auto node = &nodeAndReg.node;
+    // The outputs of fused producers and the tensors of tiled operations are
+    // emitted with the node.
+    if (tiling.getTiledIndex(i) >= 0) continue;
+    for (auto tensorArray : {node->inputs, node->outputs}) {
+      if (tensorArray == node->outputs && fusion.producers.count(i)) continue;
+      if (tensorArray) {
+        AddConstBlock(tensorArray,
+                      TfLiteIntArrayGetSizeInBytes(tensorArray->size));
+      }
+    }
+    AddConstBlock(node->custom_initial_data, node->custom_initial_data_size);
+  }
+  constData.finalize();
+  offsetContext.setConstData(&constData);
+
+  // Run memory planning with the selected planner. The greedy planner keeps
+  // its state in plannerBuf, sized for all buffers that can be added.
+  size_t maxPlanBuffers = interpreter.tensors_size() + scratchRequests.size() +
+                          tiling.bufferBytes.size();
+  std::vector<uint8_t> plannerBuf(
+      maxPlanBuffers * tflite::GreedyMemoryPlanner::per_buffer_size());
+  tflite::GreedyMemoryPlanner greedyPlanner(plannerBuf.data(),
+                                            plannerBuf.size());
+  OptimalMemPlanner optimalPlanner(options.plannerTimeLimitMs);
+  bool useOptimalPlanner = options.planner == Options::Planner::Optimal;
+  CachedMemPlanner planner(
+      useOptimalPlanner ? static_cast<tflite::MemoryPlanner *>(&optimalPlanner)
+                        : &greedyPlanner,
+      cachedPlan);
   printf("num tensors: %lu\n", interpreter.tensors_size());
+  auto sharedBuffers =
+      PlanSharedBuffers(&interpreter, schedule, fusion, lifetimes, viewInputs,
+                        options.inPlace);
+  auto bufferLifetimes = GetBufferLifetimes(lifetimes, sharedBuffers);
   std::map<int, int> tensorToPlanBuffer;
   for (int i = 0; i < interpreter.tensors_size(); i++) {
-    if (!lifetimes[i].needsAlloc) continue;
+    if (!lifetimes[i].needsAlloc || sharedBuffers.count(i)) continue;
     size_t sz = Align(interpreter.tensor(i)->bytes, (size_t)16);
-    planner.AddBuffer(&error_reporter, sz, lifetimes[i].firstUse,
-                      lifetimes[i].lastUse);
+    planner.AddBuffer(&error_reporter, sz, bufferLifetimes[i].firstUse,
+                      bufferLifetimes[i].lastUse);
     tensorToPlanBuffer[i] = planner.GetBufferCount() - 1;
   }
-  planner.PrintMemoryPlan(&error_reporter);
+  for (const auto &shared : sharedBuffers) {
+    printf("tensor %s: buffer of %s\n", tensorNames[shared.first].c_str(),
+           tensorNames[shared.second].c_str());
+    tensorToPlanBuffer[shared.first] = tensorToPlanBuffer[shared.second];
+  }
+  // Scratch buffers are only used during their operation.
+  std::map<int, int> scratchToPlanBuffer;
+  for (size_t i = 0; i < scratchRequests.size(); i++) {
+    const auto &request = scratchRequests[i];
+    if (!isScheduled[request.nodeIndex]) continue;
+    planner.AddBuffer(&error_reporter, Align(request.len, (size_t)16),
+                      request.nodeIndex, request.nodeIndex);
+    scratchToPlanBuffer[i] = planner.GetBufferCount() - 1;
+  }
+  // Band buffers are live during the whole tiled block.
+  std::vector<int> bandBufferToPlanBuffer;
+  for (size_t bytes : tiling.bufferBytes) {
+    bandBufferToPlanBuffer.push_back(-1);
+    if (!bytes) continue;
+    planner.AddBuffer(&error_reporter, Align(bytes, (size_t)16),
+                      tiling.ops.front().op, tiling.ops.back().op);
+    bandBufferToPlanBuffer.back() = planner.GetBufferCount() - 1;
+  }
+  if (planner.isCacheHit()) {
+    printf("memory plan: %lu bytes from plan cache\n",
+           planner.GetMaximumMemorySize());
+  } else if (useOptimalPlanner) {
+    optimalPlanner.PrintMemoryPlan(&error_reporter);
+  } else {
+    greedyPlanner.PrintMemoryPlan(&error_reporter);
+  }
+  if (!planCacheFile.empty()) {
+    planner.storePlan(&error_reporter, &newPlan);
+    if (!SaveCachedPlan(planCacheFile, newPlan)) {
+      printf("failed to write plan cache %s\n", planCacheFile.c_str());
+    }
+  }
 
-  std::stringstream setupCode;
-  int numQuants = 0;
-  int intArrayBufSize = 0;
-  int floatArrayBufSize = 0;
-
-  size_t tensorStructsSz = interpreter.tensors_size() * sizeof(TfLiteTensor);
-  memMap.record(OfflineOffset(interpreter.tensor(0)), tensorStructsSz,
-                "TensorStructs");
-
-  setupCode << "  // Setup tensors.\n";
-  setupCode << "  g_ctx.tensors_size = " << tensors->size() << ";\n";
-  setupCode << "  g_ctx.tensors = (TfLiteTensor*)"
-            << OfflineOffset(interpreter.tensor(0)).getPtrCode() << ";\n";
-  setupCode << "  for (size_t i = 0; i < " << interpreter.tensors_size()
-            << "; i++) {\n";
-  setupCode << "    TfLiteTensor *tensor = &g_ctx.tensors[i];\n";
-  setupCode << "    *tensor = {};\n";
-  setupCode << "    //ConvertTensorType();\n";
-  setupCode << "  }\n";
+  // Build the target arena from the plan. Everything else the target code
+  // points to in the arena is packed behind the planned buffers.
+  ArenaLayout arenaLayout;
+  arenaLayout.setPlannedSize(planner.GetMaximumMemorySize());
+  for (const auto &alloc : allocations) {
+    OfflineOffset offset(offsetContext, alloc.p);
+    assert(offset.getType() == OfflineOffset::Type::Arena &&
+           "Unexpected ptr loc");
+    arenaLayout.addBlock(offset.getOffset(), alloc.len);
+  }
   for (int i = 0; i < interpreter.tensors_size(); i++) {
-    OfflineOffset tensorDataOffset(interpreter.tensor(i)->data.data);
-    if (lifetimes[i].needsAlloc) {
+    OfflineOffset tensorDataOffset(offsetContext,
+                                   interpreter.tensor(i)->data.data);
+    if (tensorUsed[i] && !lifetimes[i].needsAlloc &&
+        !foldedTensors.count(i) &&
+        tensorDataOffset.getType() == OfflineOffset::Type::Arena) {
+      // E.g. variable tensors.
+      arenaLayout.addBlock(tensorDataOffset.getOffset(),
+                           interpreter.tensor(i)->bytes);
+    }
+  }
+  arenaLayout.finalize();
+  offsetContext.setArenaLayout(&arenaLayout);
+  size_t arenaSize = arenaLayout.getSize();
+
+  // The memory map's timeline covers all operations of the model. Buffers
+  // outside the plan are live during the whole inference.
+  std::vector<std::string> memMapOps;
+  for (size_t i = 0; i < interpreter.operators_size(); i++) {
+    auto reg = interpreter.node_and_registration(i).registration;
+    auto code = tflite::EnumValuesBuiltinOperator()[reg->builtin_code];
+    memMapOps.push_back(std::to_string(i) + ":" +
+                        tflite::EnumNameBuiltinOperator(code));
+  }
+  memMap.setOps(memMapOps);
+  int lastOp = (int)interpreter.operators_size() - 1;
+
+  CodeParts parts;
+  for (const auto &alloc : allocations) {
+    OfflineOffset offset(offsetContext, alloc.p);
+    parts.fakeAllocs.push_back(offset);
+    memMap.record(offset, alloc.len,
+                  "PersistentBuffer_L" + std::to_string(alloc.nodeIndex), 0,
+                  lastOp);
+  }
+
+  // Snapshot the kernel data that init and prepare produced, so that the
+  // target only needs to restore it.
+  std::vector<PersistentSnapshot> snapshots;
+  bool useSnapshot =
+      options.snapshotPrepare &&
+      SnapshotPersistentBuffers(allocations, interpreter, schedule,
+                                model_data, tensor_arena, tensorArenaSize,
+                                offsetContext, options.targetPtrSize,
+                                &snapshots);
+  if (options.snapshotPrepare && !useSnapshot) {
+    printf("Falling back to init and prepare on the target\n");
+    snapshots.clear();
+  }
+
+  // The target hands out scratch buffer indices in request order. Snapshots
+  // keep the indices of the offline interpreter, including those of folded
+  // operations, which get no buffer.
+  for (size_t i = 0; i < scratchRequests.size(); i++) {
+    OfflineOffset offset(offsetContext, nullptr);
+    if (!scratchToPlanBuffer.count(i)) {
+      if (useSnapshot) parts.scratchBuffers.push_back(offset);
+      continue;
+    }
+    int bufferOffset = 0;
+    planner.GetOffsetForBuffer(&error_reporter, scratchToPlanBuffer[i],
+                               &bufferOffset);
+    offset.setArenaOffset(bufferOffset);
+    parts.scratchBuffers.push_back(offset);
+    memMap.record(offset, scratchRequests[i].len,
+                  "ScratchBuffer_L" +
+                      std::to_string(scratchRequests[i].nodeIndex),
+                  scratchRequests[i].nodeIndex, scratchRequests[i].nodeIndex);
+  }
+
+  // Tensors, nodes and their parameters are initialized statically on the
+  // target. Only what the kernels may modify is placed in RAM.
+  std::stringstream dataCode;
+  if (useSnapshot) {
+    dataCode << "static_assert(sizeof(void *) == " << options.targetPtrSize
+             << ", \"Kernel data was prepared for a different ABI\");\n";
+  }
+  auto GetTensorCode = [](TfLiteType type, const std::string &dataCode,
+                          const std::string &dimsCode,
+                          TfLiteQuantizationParams params, bool isConst,
+                          size_t bytes, bool isVariable,
+                          const std::string &quantizationCode) {
+    std::stringstream tensorCode;
+    tensorCode << "{(TfLiteType)" << type << " /* " << TfLiteTypeGetName(type)
+               << " */, {(int32_t*)" << dataCode << "}, (TfLiteIntArray*)"
+               << dimsCode << ", {" << GetFloatCode(params.scale) << ", "
+               << params.zero_point << "}, "
+               << (isConst ? "kTfLiteMmapRo" : "kTfLiteArenaRw") << ", "
+               << bytes << ", nullptr, nullptr, nullptr, 0, false, "
+               << (isVariable ? "true" : "false") << ", " << quantizationCode
+               << "}";
+    return tensorCode.str();
+  };
+  std::vector<TfLiteType> tensorTypes(interpreter.tensors_size());
+  std::vector<TfLiteQuantizationParams> tensorParams(
+      interpreter.tensors_size());
+  std::vector<std::string> tensorQuantizationCodes(interpreter.tensors_size());
+  std::set<int> memMapPlanBuffers;
+  for (int i = 0; i < interpreter.tensors_size(); i++) {
+    OfflineOffset tensorDataOffset(offsetContext,
+                                   interpreter.tensor(i)->data.data);
+    OfflineOffset dimsOffset(offsetContext, tensors->Get(i)->shape());
+    if (!tensorUsed[i]) {
+      tensorDataOffset.set(nullptr);
+      dimsOffset.set(nullptr);
+    } else if (!tensorDataUsed[i]) {
+      tensorDataOffset.set(nullptr);
+    } else if (foldedTensorOffsets.count(i)) {
+      tensorDataOffset.setFBOffset(foldedTensorOffsets[i]);
+    } else if (lifetimes[i].needsAlloc) {
       int bufferOffset = 0;
       planner.GetOffsetForBuffer(&error_reporter, tensorToPlanBuffer[i],
                                  &bufferOffset);
-      tensorDataOffset.set(tensor_arena + bufferOffset);
+      tensorDataOffset.setArenaOffset(bufferOffset);
+    }
+    // Each plan buffer adds to the timeline once, with the lifetime of all
+    // tensors that share it. The other tensors are listed as annotations.
+    bool isPlanned = lifetimes[i].needsAlloc && tensorDataUsed[i];
+    std::string memMapTag = tensorNames[i];
+    if (sharedBuffers.count(i)) {
+      memMapTag += " (buffer of " + tensorNames[sharedBuffers[i]] + ")";
+    }
+    if (!isPlanned ||
+        tensorDataOffset.getType() != OfflineOffset::Type::Arena) {
+      memMap.record(tensorDataOffset, interpreter.tensor(i)->bytes, memMapTag,
+                    0, lastOp);
+    } else {
+      int owner = sharedBuffers.count(i) ? sharedBuffers[i] : i;
+      bool isFirstOfBuffer =
+          memMapPlanBuffers.insert(tensorToPlanBuffer[i]).second;
+      const auto &lifetime =
+          isFirstOfBuffer ? bufferLifetimes[owner] : lifetimes[i];
+      memMap.record(tensorDataOffset, interpreter.tensor(i)->bytes, memMapTag,
+                    lifetime.firstUse, lifetime.lastUse, isFirstOfBuffer);
     }
-    memMap.record(tensorDataOffset, interpreter.tensor(i)->bytes,
-                  tensorNames[i]);
 
-    std::string tensorI = "  g_ctx.tensors[" + std::to_string(i) + "]";
-    setupCode << tensorI << ".data.data = (void*)"
-              << tensorDataOffset.getPtrCode() << ";\n";
-    // TODO: Do these assignments offline. Tricky: ABI differences
     TfLiteType type;
     ConvertTensorType(tensors->Get(i)->type(), &type, &error_reporter);
-    setupCode << tensorI << ".type = (TfLiteType)" << type << "; // "
-              << TfLiteTypeGetName(type) << "\n";
-    setupCode << tensorI << ".is_variable = " << tensors->Get(i)->is_variable()
-              << ";\n";
-    setupCode << tensorI << ".allocation_type = "
-              << ((tensorDataOffset.getType() == OfflineOffset::Type::FB)
-                      ? "kTfLiteMmapRo"
-                      : "kTfLiteArenaRw")
-              << ";\n";
-    setupCode << tensorI << ".bytes = " << interpreter.tensor(i)->bytes
-              << ";\n";
-    setupCode << tensorI << ".dims = (TfLiteIntArray*)"
-              << OfflineOffset(tensors->Get(i)->shape()).getPtrCode() << ";\n";
+    TfLiteQuantizationParams params = {0.0f, 0};
+    std::string quantizationCode = "{kTfLiteNoQuantization, nullptr}";
     auto quant = tensors->Get(i)->quantization();
     if (quant && quant->scale() && quant->scale()->size() > 0 &&
         quant->zero_point() && quant->zero_point()->size() > 0) {
-      setupCode << tensorI << ".params.scale = " << quant->scale()->Get(0)
-                << ";\n";
-      setupCode << tensorI << ".params.zero_point = "
-                << (int32_t)quant->zero_point()->Get(0) << ";\n";
+      params.scale = quant->scale()->Get(0);
+      params.zero_point = quant->zero_point()->Get(0);
 
-      std::string quantI = "  g_quants[" + std::to_string(numQuants) + "]";
-      numQuants++;
+      std::string suffix = std::to_string(i);
       int channels = quant->scale()->size();
-      setupCode << quantI << ".zero_point = (TfLiteIntArray*)&g_intArrayBuf["
-                << intArrayBufSize << "];\n";
-      intArrayBufSize += TfLiteIntArrayGetSizeInBytes(channels);
-      setupCode << quantI << ".scale = (TfLiteFloatArray*)&g_floatArrayBuf["
-                << floatArrayBufSize << "];\n";
-      floatArrayBufSize += TfLiteFloatArrayGetSizeInBytes(channels);
-      setupCode << quantI << ".zero_point->size = " << channels << ";\n";
-      setupCode << quantI << ".scale->size = " << channels << ";\n";
+      dataCode << "const struct { int size; float data[" << channels
+               << "]; } g_scales" << suffix << " = {" << channels << ", {";
       for (int c = 0; c < channels; c++) {
-        setupCode << quantI << ".zero_point->data[" << c
-                  << "] = " << quant->zero_point()->Get(c) << ";\n";
-        setupCode << quantI << ".scale->data[" << c
-                  << "] = " << quant->scale()->Get(c) << ";\n";
+        dataCode << (c ? ", " : "") << GetFloatCode(quant->scale()->Get(c));
       }
-      setupCode << quantI
-                << ".quantized_dimension = " << quant->quantized_dimension()
-                << ";\n";
-      setupCode << tensorI << ".quantization = {kTfLiteAffineQuantization, &"
-                << quantI << "};\n";
+      dataCode << "}};\n";
+      dataCode << "const struct { int size; int data[" << channels
+               << "]; } g_zeroPoints" << suffix << " = {" << channels << ", {";
+      for (int c = 0; c < channels; c++) {
+        dataCode << (c ? ", " : "") << quant->zero_point()->Get(c);
+      }
+      dataCode << "}};\n";
+      dataCode << "const TfLiteAffineQuantization g_quant" << suffix
+               << " = {(TfLiteFloatArray*)&g_scales" << suffix
+               << ", (TfLiteIntArray*)&g_zeroPoints" << suffix << ", "
+               << quant->quantized_dimension() << "};\n";
+      quantizationCode =
+          "{kTfLiteAffineQuantization, (void*)&g_quant" + suffix + "}";
     }
+
     // Do not copy tensor name, not used on target.
+    tensorTypes[i] = type;
+    tensorParams[i] = params;
+    tensorQuantizationCodes[i] = quantizationCode;
+    parts.tensorRows.push_back(
+        {tensorNames[i],
+         GetTensorCode(
+             type, tensorDataOffset.getPtrCode(), dimsOffset.getPtrCode(),
+             params, tensorDataOffset.getType() == OfflineOffset::Type::FB,
+             interpreter.tensor(i)->bytes, tensors->Get(i)->is_variable(),
+             quantizationCode)});
+  }
+  // Band tensors of the tiled block. Those without a buffer get their data
+  // pointer in Eval.
+  std::vector<OfflineOffset> bandBufferOffsets;
+  for (size_t k = 0; k < bandBufferToPlanBuffer.size(); k++) {
+    bandBufferOffsets.emplace_back(offsetContext, nullptr);
+    if (bandBufferToPlanBuffer[k] < 0) continue;
+    int bufferOffset = 0;
+    planner.GetOffsetForBuffer(&error_reporter, bandBufferToPlanBuffer[k],
+                               &bufferOffset);
+    bandBufferOffsets.back().setArenaOffset(bufferOffset);
+    memMap.record(bandBufferOffsets.back(), tiling.bufferBytes[k],
+                  "TileBuffer" + std::to_string(k), tiling.ops.front().op,
+                  tiling.ops.back().op);
+  }
+  for (size_t k = 0; k < tiling.bandTensors.size(); k++) {
+    const auto &band = tiling.bandTensors[k];
+    int i = tiling.firstBandTensor + k;
+    OfflineOffset bandDataOffset(offsetContext, nullptr);
+    if (band.buffer >= 0) bandDataOffset = bandBufferOffsets[band.buffer];
+    std::vector<std::string> dims;
+    for (int d : band.dims) dims.push_back(std::to_string(d));
+    dataCode << "const int g_bandDims" << i << "[] = "
+             << GetArrayCode(dims, "0") << ";\n";
+    std::string name =
+        "T" + std::to_string(i) + "_band_" + tensorNames[band.source];
+    parts.tensorRows.push_back(
+        {name, GetTensorCode(tensorTypes[band.source],
+                             bandDataOffset.getPtrCode(),
+                             "g_bandDims" + std::to_string(i),
+                             tensorParams[band.source], false, band.bytes,
+                             false, tensorQuantizationCodes[band.source])});
   }
-  setupCode << "\n";
 
   // Find all used operations and only use those in the target code.
   struct Op {
@@ -498,135 +1492,620 @@ static bool Run(const std::string &modelFileName,
       if (code == op.code) return version < op.version;
       return code < op.code;
     }
-    bool operator==(const Op &op) {
-      return code == op.code && version == op.version;
-    }
   };
   std::vector<Op> usedRegistrations;
+  std::map<Op, int> registrationIndices;
   std::vector<int> opToRegistration;
-  auto nOps = interpreter.operators_size();
-  for (int i = 0; i < nOps; i++) {
-    auto nodeAndReg = interpreter.node_and_registration(i);
-    auto node = &nodeAndReg.node;
-    auto reg = nodeAndReg.registration;
+  for (int i : schedule) {
+    auto fusedNode = GetNode(i);
+    tiling.applyTo(i, &fusedNode);
+    auto node = &fusedNode;
+    auto reg = interpreter.node_and_registration(i).registration;
     auto code = tflite::EnumValuesBuiltinOperator()[reg->builtin_code];
 
-    auto GetFBOffset = [&](void *p) {
-      return (void *)((uintptr_t)p - (uintptr_t)model_data.data());
-    };
-
     printf("operation %i: %s\n", i, tflite::EnumNamesBuiltinOperator()[code]);
 
     Op op{code, reg->version};
-    auto itOp =
-        std::find(usedRegistrations.begin(), usedRegistrations.end(), op);
-    if (itOp == usedRegistrations.end()) {
-      itOp = usedRegistrations.insert(usedRegistrations.end(), op);
+    auto itOp = registrationIndices.find(op);
+    if (itOp == registrationIndices.end()) {
+      itOp = registrationIndices.emplace(op, usedRegistrations.size()).first;
+      usedRegistrations.push_back(op);
     }
-    opToRegistration.push_back(itOp - usedRegistrations.begin());
+    opToRegistration.push_back(itOp->second);
 
     // Build node.
-    setupCode << "  {\n";
-    setupCode << "    TfLiteNode &node = g_node[" << i << "];\n";
-    setupCode << "    node.inputs = (TfLiteIntArray*)"
-              << OfflineOffset(node->inputs).getPtrCode() << ";\n";
-    setupCode << "    node.outputs = (TfLiteIntArray*)"
-              << OfflineOffset(node->outputs).getPtrCode() << ";\n";
-    setupCode << "    node.temporaries = nullptr;\n";
-    setupCode << GetDeepCopyCode(node->builtin_data,
-                                 GetBuiltinDataSize(code, subgraph),
-                                 "node.builtin_data", "    ");
-    setupCode << "    node.custom_initial_data = "
-              << OfflineOffset(node->custom_initial_data).getPtrCode() << ";\n";
-    setupCode << "    node.custom_initial_data_size = "
-              << node->custom_initial_data_size << ";\n";
-    setupCode << "    node.delegate = nullptr;\n";
-    setupCode << "  }\n";
+    std::string builtinDataCode = "nullptr";
+    if (node->builtin_data) {
+      std::string varName = "g_builtinData" + std::to_string(i);
+      dataCode << "const char " << varName
+               << "[] __attribute__((aligned(8))) = "
+               << GetByteArrayCode(node->builtin_data,
+                                   GetBuiltinDataSize(code, subgraph))
+               << ";\n";
+      builtinDataCode = "(void*)" + varName;
+    }
+    if (packedLayers.count(i)) {
+      const auto &packed = packedLayers[i];
+      const auto &offsets = packedLayerOffsets[i];
+      auto PtrCode = [&](uintptr_t fbOffset, const std::string &type) {
+        OfflineOffset offset(offsetContext, nullptr);
+        offset.setFBOffset(fbOffset);
+        return "(const " + type + " *)" + offset.getPtrCode();
+      };
+      std::string suffix = std::to_string(i);
+      dataCode << "const PackedLayerParams g_packedLayer" << suffix << " = {"
+               << packed.inputIndex << ", " << packed.outputIndex << ", "
+               << packed.numRows << ", " << packed.accumDepth << ", "
+               << packed.outputDepth << ", "
+               << PtrCode(offsets.weights, "int8_t") << ", "
+               << PtrCode(offsets.bias, "int32_t") << ", "
+               << PtrCode(offsets.outputMultipliers, "int32_t") << ", "
+               << PtrCode(offsets.outputShifts, "int32_t") << ", "
+               << packed.outputOffset << ", " << packed.activationMin << ", "
+               << packed.activationMax << "};\n";
+    }
+    std::string inputsCode = GetPtrCode(node->inputs);
+    std::string outputsCode = GetPtrCode(node->outputs);
+    if (tiling.getTiledIndex(i) >= 0) {
+      auto IntArrayCode = [&](const TfLiteIntArray *array,
+                              const std::string &varName) {
+        std::vector<std::string> elements;
+        for (int k = 0; k < array->size; k++) {
+          elements.push_back(std::to_string(array->data[k]));
+        }
+        dataCode << "const struct { int size; int data[" << array->size
+                 << "]; } " << varName << " = {" << array->size << ", "
+                 << GetArrayCode(elements, "0") << "};\n";
+        return "&" + varName;
+      };
+      inputsCode =
+          IntArrayCode(node->inputs, "g_nodeInputs" + std::to_string(i));
+      outputsCode =
+          IntArrayCode(node->outputs, "g_nodeOutputs" + std::to_string(i));
+    } else if (fusion.producers.count(i)) {
+      std::string varName = "g_nodeOutputs" + std::to_string(i);
+      dataCode << "const struct { int size; int data[1]; } " << varName
+               << " = {1, {" << node->outputs->data[0] << "}};\n";
+      outputsCode = "&" + varName;
+    }
+    std::stringstream nodeCode;
+    nodeCode << "{(TfLiteIntArray*)" << inputsCode << ", (TfLiteIntArray*)"
+             << outputsCode
+             << ", nullptr, nullptr, (void*)"
+             << (useSnapshot ? GetPtrCode(node->user_data) : "nullptr")
+             << ", " << builtinDataCode << ", "
+             << GetPtrCode(node->custom_initial_data) << ", "
+             << node->custom_initial_data_size << ", nullptr}";
+    parts.nodeRows.push_back(
+        {"L" + std::to_string(i) + " " +
+             tflite::EnumNameBuiltinOperator(op.code),
+         nodeCode.str()});
   }
 
-  {
-    int i = 0;
-    for (const auto &reg : usedRegistrations) {
-      auto opName = tflite::EnumNameBuiltinOperator(reg.code);
-      setupCode << "  g_regOp[" << i << "] = tflite::ops::micro::Register_"
-                << opName << "();\n";
-      i++;
+  std::stringstream setupCode;
+  setupCode << "  g_ctx.tensors_size = " << parts.tensorRows.size() << ";\n";
+  setupCode << "  g_ctx.tensors = g_tensors;\n";
+  setupCode << "\n";
+
+  // Known kernels are called directly in Eval. Their registration is only
+  // needed for init and prepare.
+  std::vector<const KernelEvalSymbol *> regEvalSymbols(
+      usedRegistrations.size());
+  std::stringstream declCode;
+  if (!packedLayers.empty()) {
+    declCode << GetPackedLayerKernelCode();
+  }
+  if (!tiling.ops.empty()) {
+    declCode << GetTilingCode();
+  }
+  for (const auto &chain : fusion.chains) {
+    declCode << GetElementwiseChainCode(
+        chain.second, "EvalElementwiseChain" + std::to_string(chain.first));
+  }
+  for (size_t k = 0; k < schedule.size() && options.directCalls; k++) {
+    auto r = opToRegistration[k];
+    if (!regEvalSymbols[r]) {
+      auto reg = interpreter.node_and_registration(schedule[k]).registration;
+      regEvalSymbols[r] = FindKernelEvalSymbol(reg);
+      if (regEvalSymbols[r]) {
+        declCode << GetKernelEvalDeclCode(*regEvalSymbols[r]);
+      }
+    }
+  }
+
+  // Without init and prepare, directly called kernels need no registration and
+  // the linker can drop it.
+  std::stringstream regCode;
+  for (size_t i = 0; i < usedRegistrations.size(); i++) {
+    if (useSnapshot && regEvalSymbols[i]) {
+      continue;
+    }
+    auto opName = tflite::EnumNameBuiltinOperator(usedRegistrations[i].code);
+    regCode << "  g_regOp[" << i << "] = tflite::ops::micro::Register_"
+            << opName << "();\n";
+  }
+
+  // Restore the kernel data and relocate its pointers.
+  for (size_t k = 0; k < snapshots.size(); k++) {
+    const auto &snapshot = snapshots[k];
+    std::vector<char> data((char *)snapshot.alloc->p,
+                           (char *)snapshot.alloc->p + snapshot.alloc->len);
+    for (auto ptrOffset : snapshot.ptrOffsets) {
+      std::fill_n(data.begin() + ptrOffset, options.targetPtrSize, 0);
+    }
+    std::string varName = "g_persistentData" + std::to_string(k);
+    dataCode << "const unsigned char " << varName
+             << "[] __attribute__((aligned(16))) = "
+             << GetByteArrayCode(data.data(), data.size()) << ";\n";
+    setupCode << "  memcpy(" << GetPtrCode(snapshot.alloc->p) << ", " << varName
+              << ", " << data.size() << ");\n";
+    for (auto ptrOffset : snapshot.ptrOffsets) {
+      auto p = ReadTargetPointer((char *)snapshot.alloc->p + ptrOffset,
+                                 options.targetPtrSize);
+      setupCode << "  *(void**)"
+                << GetPtrCode((char *)snapshot.alloc->p + ptrOffset)
+                << " = (void*)" << GetPtrCode(p) << ";\n";
     }
   }
 
   // Call "Init" on operations.
-  for (int i = 0; i < nOps; i++) {
-    auto &nodeAndReg = interpreter.node_and_registration(i);
+  for (size_t k = 0; k < schedule.size() && !useSnapshot; k++) {
+    auto nodeAndReg = interpreter.node_and_registration(schedule[k]);
     if (nodeAndReg.registration->init) {
-      std::string nodeStr = "g_node[" + std::to_string(i) + "]";
+      std::string nodeStr = "g_node[" + std::to_string(k) + "]";
       std::string ptrArg = nodeAndReg.node.builtin_data
                                ? "(const char *)" + nodeStr + ".builtin_data"
                                : "nullptr";
 
       // Length arg should be zero according to doc.
       setupCode << "  " << nodeStr << ".user_data = g_regOp["
-                << opToRegistration[i] << "]->init(&g_ctx, " << ptrArg
+                << opToRegistration[k] << "]->init(&g_ctx, " << ptrArg
                 << ", 0);\n";
     }
   }
 
   // Call "Prepare" on operations.
-  for (int i = 0; i < nOps; i++) {
-    if (interpreter.node_and_registration(i).registration->prepare) {
-      setupCode << "  g_regOp[" << opToRegistration[i]
-                << "]->prepare(&g_ctx, &g_node[" << i << "]);\n";
+  for (size_t k = 0; k < schedule.size() && !useSnapshot; k++) {
+    if (interpreter.node_and_registration(schedule[k]).registration->prepare) {
+      setupCode << "  g_regOp[" << opToRegistration[k]
+                << "]->prepare(&g_ctx, &g_node[" << k << "]);\n";
     }
   }
 
-  // Eval code: Just call into original operators.
+  // Eval code: Just call into original operators. Chains run in place of their
+  // last operation. With profiling, every call is wrapped in hooks.
   std::stringstream evalCode;
-  for (int i = 0; i < nOps; i++) {
-    evalCode << "  g_regOp[" << opToRegistration[i]
-             << "]->invoke(&g_ctx, &g_node[" << i << "]);\n";
+  std::vector<ProfileEntry> profileEntries;
+  std::string evalIndent = "  ";
+  auto AddEvalCall = [&](const std::string &opName,
+                         const std::vector<int> &tensorIndices,
+                         const std::string &call) {
+    if (!options.profile) {
+      evalCode << evalIndent << call << ";\n";
+      return;
+    }
+    std::string tensorNamesStr;
+    for (int t : tensorIndices) {
+      if (t < 0) continue;
+      tensorNamesStr += (tensorNamesStr.empty() ? "" : " ") + tensorNames[t];
+    }
+    std::string args = std::to_string(profileEntries.size()) +
+                       ", g_profileOps[" +
+                       std::to_string(profileEntries.size()) +
+                       "], g_profileTensors[" +
+                       std::to_string(profileEntries.size()) + "]";
+    evalCode << evalIndent << "OpProfileBegin(" << args << ");\n";
+    evalCode << evalIndent << call << ";\n";
+    evalCode << evalIndent << "OpProfileEnd(" << args << ");\n";
+    profileEntries.push_back({opName, tensorNamesStr});
+  };
+  auto itChain = fusion.chains.begin();
+  auto AddChainsBefore = [&](int i) {
+    for (; itChain != fusion.chains.end() && itChain->first < i; ++itChain) {
+      const auto &chain = itChain->second;
+      std::vector<int> tensorIndices = {chain.input};
+      for (const auto &step : chain.steps) {
+        tensorIndices.push_back(step.otherInput);
+      }
+      tensorIndices.push_back(chain.output);
+      AddEvalCall("ELEMENTWISE_CHAIN", tensorIndices,
+                  "EvalElementwiseChain" + std::to_string(itChain->first) +
+                      "(&g_ctx)");
+    }
+  };
+  auto AddOpCall = [&](size_t k) {
+    int i = schedule[k];
+    auto node = GetNode(i);
+    tiling.applyTo(i, &node);
+    std::vector<int> tensorIndices(node.inputs->data,
+                                   node.inputs->data + node.inputs->size);
+    tensorIndices.insert(tensorIndices.end(), node.outputs->data,
+                         node.outputs->data + node.outputs->size);
+    auto opName = tflite::EnumNameBuiltinOperator(
+        usedRegistrations[opToRegistration[k]].code);
+    std::string nodeArg = "(&g_ctx, &g_node[" + std::to_string(k) + "])";
+    if (packedLayers.count(i)) {
+      AddEvalCall(opName, tensorIndices,
+                  "EvalPackedLayer(&g_ctx, g_packedLayer" +
+                      std::to_string(i) + ")");
+    } else if (auto symbol = regEvalSymbols[opToRegistration[k]]) {
+      AddEvalCall(opName, tensorIndices, GetKernelEvalName(*symbol) + nodeArg);
+    } else {
+      AddEvalCall(opName, tensorIndices,
+                  "g_regOp[" + std::to_string(opToRegistration[k]) +
+                      "]->invoke" + nodeArg);
+    }
+  };
+  for (size_t k = 0; k < schedule.size(); k++) {
+    int i = schedule[k];
+    AddChainsBefore(i);
+    int tiledIndex = tiling.getTiledIndex(i);
+    if (tiledIndex > 0) continue;
+    if (tiledIndex < 0) {
+      AddOpCall(k);
+      continue;
+    }
+    // The tiled block runs all its operations on one band after the other.
+    evalCode << "  for (int band = 0; band < " << tiling.numTiles
+             << "; band++) {\n";
+    evalIndent = "    ";
+    if (options.multiInstance) {
+      evalCode << evalIndent
+               << "TfLiteTensor *const g_tensors = inst->tensors;\n";
+    }
+    for (size_t b = 0; b < tiling.ops.size(); b++) {
+      assert(schedule[k + b] == tiling.ops[b].op && "Block must be in order");
+      std::stringstream bandCode(tiling.ops[b].bandCode);
+      std::string line;
+      while (std::getline(bandCode, line)) {
+        evalCode << evalIndent << line << "\n";
+      }
+      AddOpCall(k + b);
+    }
+    evalIndent = "  ";
+    evalCode << "  }\n";
+  }
+  AddChainsBefore(interpreter.operators_size());
+  if (options.profile) {
+    declCode << GetOpProfileCode(profileEntries);
   }
 
-  // TODO: If a different memory planner is used than in DryRunModel,
-  // tensorArenaSize is no longer correct and needs to be adjusted.
+  // Typed accessors for all inputs and outputs. The untyped ones access the
+  // first or the indexed input and output.
+  std::stringstream ioCode;
+  std::string instParam = options.multiInstance ? "ModelInstance *inst" : "";
+  std::string tensorsVar =
+      options.multiInstance ? "inst->tensors" : "g_tensors";
+  auto AddIOCode = [&](const char *kind, const char *qualifier,
+                       const flatbuffers::Vector<int32_t> *indices) {
+    for (size_t k = 0; k < indices->size(); k++) {
+      int i = indices->Get(k);
+      auto typeCode = GetTypeCode(interpreter.tensor(i)->type);
+      ioCode << "// " << tensorNames[i] << "\n";
+      ioCode << qualifier << typeCode << " *Get" << kind << k << "("
+             << instParam << ") { return (" << qualifier << typeCode << " *)"
+             << tensorsVar << "[" << i << "].data.data; }\n";
+    }
+    ioCode << qualifier << "void *Get" << kind << "Ptr(" << instParam
+           << ") { return " << tensorsVar << "[" << indices->Get(0)
+           << "].data.data; }\n";
+    std::vector<std::string> tensorIndices;
+    for (size_t k = 0; k < indices->size(); k++) {
+      tensorIndices.push_back(std::to_string(indices->Get(k)));
+    }
+    ioCode << qualifier << "void *Get" << kind << "Ptr(" << instParam
+           << (options.multiInstance ? ", " : "") << "int index) {\n";
+    ioCode << "  static const int kTensors[] = "
+           << GetArrayCode(tensorIndices, "0") << ";\n";
+    ioCode << "  return " << tensorsVar << "[kTensors[index]].data.data;\n";
+    ioCode << "}\n";
+  };
+  AddIOCode("Input", "", subgraph->inputs());
+  AddIOCode("Output", "const ", subgraph->outputs());
 
   // Produce output code.
-  std::ofstream outFile(outFileName);
-  outFile << FillCodeTemplate(
-      model_data, tensorArenaSize, setupCode.str(), evalCode.str(),
-      usedRegistrations.size(), nOps, numQuants, intArrayBufSize,
-      floatArrayBufSize, inputTensorIndex, outputTensorIndex, fakeAllocPtrs);
-
-  printf("Required tensor memory: %lu\n", tensorArenaSize);
-
-  auto Test = [&](float x_val) {
-    interpreter.input(0)->data.f[0] = x_val;
-    TfLiteStatus invoke_status = interpreter.Invoke();
-    if (invoke_status != kTfLiteOk) {
-      error_reporter.Report("Invoke failed on x_val: %f\n",
-                            static_cast<double>(x_val));
-      return -1.0f;
-    }
-    return interpreter.output(0)->data.f[0];
-  };
+  parts.declCode = declCode.str();
+  parts.dataCode = dataCode.str();
+  parts.regCode = regCode.str();
+  parts.setupCode = setupCode.str();
+  parts.evalCode = evalCode.str();
+  parts.ioCode = ioCode.str();
+  parts.numRegs = usedRegistrations.size();
+  // The code is streamed to the file, so the model data is never copied
+  // into a string.
+  std::vector<char> outFileBuf(1 << 20);
+  std::ofstream outFile;
+  outFile.rdbuf()->pubsetbuf(outFileBuf.data(), outFileBuf.size());
+  outFile.open(outFileName, std::ios::binary);
+  WriteCodeTemplate(outFile, constData.getData(), arenaSize, parts,
+                    options.multiInstance, options.weightsBinFile,
+                    options.sineTest);
+  outFile.close();
+  if (!outFile) {
+    printf("failed to write output file\n");
+    return false;
+  }
+  if (!options.weightsBinFile.empty()) {
+    std::ofstream weightsFile(options.weightsBinFile, std::ios::binary);
+    weightsFile.write(constData.getData().data(), constData.getData().size());
+    weightsFile.close();
+    if (!weightsFile) {
+      printf("failed to write weights file\n");
+      return false;
+    }
+  }
 
-  // This is testing the TFLM "sine" model.
-  printf("0:     %+.02f\n", Test(0));
-  printf("pi/2:  %+.02f\n", Test(3.14f / 2));
-  printf("pi:    %+.02f\n", Test(3.14f));
-  printf("3pi/2: %+.02f\n", Test((3 * 3.14f) / 2));
-  printf("2pi:   %+.02f\n", Test(2 * 3.14f));
+  printf("Required tensor memory: %lu (TFLM: %lu)\n", arenaSize,
+         tensorArenaSize);
+  printf("Required constant memory: %lu (flatbuffer: %lu, %d deduplicated)\n",
+         constData.getData().size(), model_data.size(),
+         constData.getNumDeduplicated());
+
+  // This is testing the TFLM "sine" model, which has one float input and
+  // output.
+  if (options.sineTest && interpreter.inputs_size() == 1 &&
+      interpreter.outputs_size() == 1 &&
+      interpreter.input(0)->type == kTfLiteFloat32 &&
+      interpreter.output(0)->type == kTfLiteFloat32) {
+    auto Test = [&](float x_val) {
+      interpreter.input(0)->data.f[0] = x_val;
+      TfLiteStatus invoke_status = interpreter.Invoke();
+      if (invoke_status != kTfLiteOk) {
+        error_reporter.Report("Invoke failed on x_val: %f\n",
+                              static_cast<double>(x_val));
+        return -1.0f;
+      }
+      return interpreter.output(0)->data.f[0];
+    };
+    printf("0:     %+.02f\n", Test(0));
+    printf("pi/2:  %+.02f\n", Test(3.14f / 2));
+    printf("pi:    %+.02f\n", Test(3.14f));
+    printf("3pi/2: %+.02f\n", Test((3 * 3.14f) / 2));
+    printf("2pi:   %+.02f\n", Test(2 * 3.14f));
+  } else if (options.sineTest) {
+    printf("--sine-test needs one float input and output, skipped\n");
+  }
 
   memMap.report();
+  if (!options.memReportJsonFile.empty() &&
+      !memMap.writeJson(options.memReportJsonFile)) {
+    printf("failed to write %s\n", options.memReportJsonFile.c_str());
+    return false;
+  }
+  if (!options.memReportCsvFile.empty() &&
+      !memMap.writeCsv(options.memReportCsvFile)) {
+    printf("failed to write %s\n", options.memReportCsvFile.c_str());
+    return false;
+  }
 
   return true;
 }
 
+// Returns the .tflite files in a directory, or the model paths that a file
+// lists one per line.
+static std::vector<std::string> GetBatchModels(const std::string &path) {
+  std::vector<std::string> models;
+  if (DIR *dir = opendir(path.c_str())) {
+    while (auto entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.size() > 7 && name.compare(name.size() - 7, 7, ".tflite") == 0) {
+        models.push_back(path + "/" + name);
+      }
+    }
+    closedir(dir);
+    std::sort(models.begin(), models.end());
+    return models;
+  }
+  std::ifstream list(path);
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty()) models.push_back(line);
+  }
+  return models;
+}
+
+// Returns the file name of a model without directory and .tflite extension.
+static std::string GetBatchModelName(const std::string &modelPath) {
+  std::string name = modelPath.substr(modelPath.find_last_of('/') + 1);
+  if (name.size() > 7 && name.compare(name.size() - 7, 7, ".tflite") == 0) {
+    name.resize(name.size() - 7);
+  }
+  return name;
+}
+
+// Generates every model of the batch into outDir on a pool of threads. The
+// output file options are suffixes of the per-model files.
+static bool RunBatch(const std::string &modelsPath, const std::string &outDir,
+                     const Options &options) {
+  auto models = GetBatchModels(modelsPath);
+  if (models.empty()) {
+    printf("No models found in %s\n", modelsPath.c_str());
+    return false;
+  }
+  // Models of a list may have the same name in different directories, their
+  // output files would overwrite each other.
+  std::map<std::string, std::string> nameToModel;
+  bool hasDuplicates = false;
+  for (const auto &model : models) {
+    auto inserted = nameToModel.insert({GetBatchModelName(model), model});
+    if (!inserted.second) {
+      printf("%s and %s have the same name\n",
+             inserted.first->second.c_str(), model.c_str());
+      hasDuplicates = true;
+    }
+  }
+  if (hasDuplicates) {
+    return false;
+  }
+  std::vector<char> succeeded(models.size());
+  std::atomic<size_t> nextModel(0);
+  auto Worker = [&]() {
+    for (size_t k = nextModel++; k < models.size(); k = nextModel++) {
+      std::string base = outDir + "/" + GetBatchModelName(models[k]);
+      Options modelOptions = options;
+      for (auto file : {&modelOptions.weightsBinFile,
+                        &modelOptions.memReportJsonFile,
+                        &modelOptions.memReportCsvFile}) {
+        if (!file->empty()) *file = base + *file;
+      }
+      succeeded[k] = Run(models[k], base + ".cpp", modelOptions);
+    }
+  };
+  size_t numThreads = options.batchJobs > 0
+                          ? options.batchJobs
+                          : std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (size_t k = 0; k < std::min(numThreads, models.size()); k++) {
+    threads.emplace_back(Worker);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  size_t numSucceeded = std::count(succeeded.begin(), succeeded.end(), 1);
+  for (size_t k = 0; k < models.size(); k++) {
+    if (!succeeded[k]) printf("failed to generate %s\n", models[k].c_str());
+  }
+  printf("generated %lu of %lu models\n", numSucceeded, models.size());
+  return numSucceeded == models.size();
+}
+
+static void PrintUsage(const char *progName) {
+  printf("usage: %s [options] modelFile.tflite outFile.cpp\n", progName);
+  printf("       %s --batch [options] modelDirOrList outDir\n", progName);
+  printf("options:\n");
+  printf("  --planner=greedy|optimal     Memory planner (default: greedy)\n");
+  printf("  --planner-time-limit=<ms>    Search time of optimal planner\n");
+  printf("  --snapshot-prepare           Skip init and prepare on target\n");
+  printf("                               (needs a generator built for the\n");
+  printf("                               target's ABI)\n");
+  printf("  --target-ptr-size=4|8        Target pointer width (default 4)\n");
+  printf("  --direct-calls               Call known kernels directly\n");
+  printf("  --multi-instance             Generate independent instances\n");
+  printf("  --weights-bin=<file>         Write constant data to binary file\n");
+  printf("  --pack-weights               Pack weights for generated kernels\n");
+  printf("  --fold-constants             Fold constant operations offline\n");
+  printf("  --fuse-ops                   Fuse activations and elementwise\n");
+  printf("  --profile                    Add profiling hooks to Eval\n");
+  printf("  --sine-test                  Test the TFLM sine example model\n");
+  printf("  --in-place                   Elementwise outputs reuse inputs\n");
+  printf("  --remove-views               Drop reshapes and identities\n");
+  printf("  --reorder-ops                Reorder operators for less memory\n");
+  printf("  --reorder-exact-limit=<n>    Max operators for exact reordering\n");
+  printf("  --tile-leading-block         Run leading convs band by band\n");
+  printf("  --max-tiles=<n>              Max bands of the tiled block\n");
+  printf("  --batch                      Generate a directory or list\n");
+  printf("  --jobs=<n>                   Threads of the batch mode\n");
+  printf("  --plan-cache=<dir>           Reuse plans of unchanged models\n");
+  printf("  --mem-report-json=<file>     Write memory map as JSON\n");
+  printf("  --mem-report-csv=<file>      Write memory map as CSV\n");
+}
+
+// Parses value as a decimal integer in [min, max]. Unlike std::stoi, this
+// fails on trailing characters and out of range values instead of throwing.
+template <typename T>
+static bool ParseInt(const std::string &value, long long min, long long max,
+                     T *out) {
+  if (value.empty() || isspace(value[0])) return false;
+  char *end;
+  errno = 0;
+  long long n = strtoll(value.c_str(), &end, 10);
+  if (errno == ERANGE || *end != '\0' || n < min || n > max) return false;
+  *out = n;
+  return true;
+}
+
+static bool ParseArgs(int argc, char *argv[], Options *options,
+                      std::vector<std::string> *positional) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = arg.substr(arg.find('=') + 1);
+    if (arg.compare(0, 2, "--") != 0) {
+      positional->push_back(arg);
+    } else if (arg == "--planner=greedy") {
+      options->planner = Options::Planner::Greedy;
+    } else if (arg == "--planner=optimal") {
+      options->planner = Options::Planner::Optimal;
+    } else if (arg.compare(0, 21, "--planner-time-limit=") == 0) {
+      if (!ParseInt(value, 0, INT_MAX, &options->plannerTimeLimitMs)) {
+        printf("invalid value: %s\n", arg.c_str());
+        return false;
+      }
+    } else if (arg == "--snapshot-prepare") {
+      options->snapshotPrepare = true;
+    } else if (arg.compare(0, 18, "--target-ptr-size=") == 0) {
+      if (!ParseInt(value, 1, 8, &options->targetPtrSize) ||
+          (options->targetPtrSize & (options->targetPtrSize - 1))) {
+        printf("invalid value: %s\n", arg.c_str());
+        return false;
+      }
+    } else if (arg == "--direct-calls") {
+      options->directCalls = true;
+    } else if (arg == "--multi-instance") {
+      options->multiInstance = true;
+    } else if (arg.compare(0, 14, "--weights-bin=") == 0) {
+      options->weightsBinFile = value;
+    } else if (arg == "--pack-weights") {
+      options->packWeights = true;
+    } else if (arg == "--fold-constants") {
+      options->foldConstants = true;
+    } else if (arg == "--fuse-ops") {
+      options->fuseOps = true;
+    } else if (arg == "--profile") {
+      options->profile = true;
+    } else if (arg == "--sine-test") {
+      options->sineTest = true;
+    } else if (arg == "--in-place") {
+      options->inPlace = true;
+    } else if (arg == "--remove-views") {
+      options->removeViews = true;
+    } else if (arg == "--reorder-ops") {
+      options->reorderOps = true;
+    } else if (arg.compare(0, 22, "--reorder-exact-limit=") == 0) {
+      if (!ParseInt(value, 0, INT_MAX, &options->maxExactReorderOps)) {
+        printf("invalid value: %s\n", arg.c_str());
+        return false;
+      }
+    } else if (arg == "--tile-leading-block") {
+      options->tileLeadingBlock = true;
+    } else if (arg.compare(0, 12, "--max-tiles=") == 0) {
+      if (!ParseInt(value, 0, INT_MAX, &options->maxTiles)) {
+        printf("invalid value: %s\n", arg.c_str());
+        return false;
+      }
+    } else if (arg == "--batch") {
+      options->batch = true;
+    } else if (arg.compare(0, 7, "--jobs=") == 0) {
+      if (!ParseInt(value, 0, INT_MAX, &options->batchJobs)) {
+        printf("invalid value: %s\n", arg.c_str());
+        return false;
+      }
+    } else if (arg.compare(0, 13, "--plan-cache=") == 0) {
+      options->planCacheDir = value;
+    } else if (arg.compare(0, 18, "--mem-report-json=") == 0) {
+      options->memReportJsonFile = value;
+    } else if (arg.compare(0, 17, "--mem-report-csv=") == 0) {
+      options->memReportCsvFile = value;
+    } else {
+      printf("unknown option: %s\n", arg.c_str());
+      return false;
+    }
+  }
+  return positional->size() == 2;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    printf("usage: %s modelFile.tflite outFile.cpp\n", argv[0]);
+  Options options;
+  std::vector<std::string> positional;
+  if (!ParseArgs(argc, argv, &options, &positional)) {
+    PrintUsage(argv[0]);
     return 1;
   }
 
-  if (!Run(argv[1], argv[2])) {
+  if (options.batch) {
+    return RunBatch(positional[0], positional[1], options) ? 0 : 1;
+  }
+  if (!Run(positional[0], positional[1], options)) {
     return 1;
   }
 